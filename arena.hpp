@@ -0,0 +1,121 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Bump allocator owning every AST node and token string of one compilation.
+// Objects are placement-constructed into large chunks and destroyed all at once
+// by release(), so the parser never frees anything individually.
+struct Arena
+{
+	static constexpr size_t ChunkSize = 64 * 1024;
+
+	Arena() = default;
+	Arena(const Arena &) = delete;
+	Arena &operator=(const Arena &) = delete;
+
+	~Arena()
+	{
+		release();
+	}
+
+	void *allocate(size_t size, size_t align = alignof(std::max_align_t))
+	{
+		auto offset = (align - reinterpret_cast<uintptr_t>(cursor) % align) % align;
+		if (cursor == nullptr || size + offset > size_t(limit - cursor))
+		{
+			grow(size + align);
+			offset = (align - reinterpret_cast<uintptr_t>(cursor) % align) % align;
+		}
+
+		auto result = cursor + offset;
+		cursor = result + size;
+		bytes += size;
+		allocations++;
+		return result;
+	}
+
+	template <typename T, typename... Args>
+	T *make(Args &&... args)
+	{
+		auto object = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+		if constexpr (!std::is_trivially_destructible_v<T>)
+		{
+			destructors.push_back({[](void *p) { static_cast<T *>(p)->~T(); }, object});
+		}
+
+		return object;
+	}
+
+	struct Mark
+	{
+		size_t chunks;
+		char *cursor;
+		char *limit;
+		size_t destructors;
+	};
+
+	Mark mark() const
+	{
+		return Mark{chunks : chunks.size(), cursor : cursor, limit : limit, destructors : destructors.size()};
+	}
+
+	// Destroys every object allocated since mark and returns the chunks it grew by to the heap
+	void rollback(const Mark &mark)
+	{
+		for (auto i = destructors.size(); i-- > mark.destructors;)
+		{
+			destructors[i].destroy(destructors[i].object);
+		}
+
+		destructors.resize(mark.destructors);
+		chunks.resize(mark.chunks);
+		cursor = mark.cursor;
+		limit = mark.limit;
+	}
+
+	// Destroys every object and returns all chunks to the heap
+	void release()
+	{
+		for (auto it = destructors.rbegin(); it != destructors.rend(); it++)
+		{
+			it->destroy(it->object);
+		}
+
+		destructors.clear();
+		chunks.clear();
+		cursor = limit = nullptr;
+	}
+
+	size_t bytesAllocated() const { return bytes; }
+	size_t allocationCount() const { return allocations; }
+	size_t chunkCount() const { return chunks.size(); }
+
+private:
+	struct Destructor
+	{
+		void (*destroy)(void *);
+		void *object;
+	};
+
+	void grow(size_t minimum)
+	{
+		auto size = minimum > ChunkSize ? minimum : ChunkSize;
+		chunks.emplace_back(new char[size]);
+		cursor = chunks.back().get();
+		limit = cursor + size;
+	}
+
+	std::vector<std::unique_ptr<char[]>> chunks;
+	std::vector<Destructor> destructors;
+	char *cursor = nullptr;
+	char *limit = nullptr;
+	size_t bytes = 0;
+	size_t allocations = 0;
+};
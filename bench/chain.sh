@@ -0,0 +1,12 @@
+#!/bin/sh
+# Emits a function whose body is one N-term chained expression, e.g.
+#   bench/chain.sh 20000 | time ./parser > /dev/null
+# Semantic analysis and code generation should scale linearly with N.
+n=${1:-10000}
+
+awk -v n="$n" 'BEGIN {
+	printf "func chain(a int, b int) int {\n\treturn a"
+	for (i = 1; i < n; i++)
+		printf (i % 2 ? " + b" : " - a")
+	printf "\n}\n"
+}'
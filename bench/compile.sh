@@ -0,0 +1,69 @@
+#!/bin/sh
+# Compile-time scaling benchmark: generates programs of growing size along one
+# dimension at a time and records wall time, peak RSS and per-phase times as CSV.
+#
+#   bench/compile.sh [compiler] > results.csv
+#
+# Environment: OPT (default -O0) is passed to the compiler, SIZES overrides the
+# scale factors, WORK is the scratch directory (default /tmp/weirdflex-bench).
+compiler=$(realpath "${1:-./parser}")
+bench=$(dirname "$(realpath "$0")")
+opt=${OPT:--O0}
+sizes=${SIZES:-1 2 4 8 16}
+work=${WORK:-/tmp/weirdflex-bench}
+
+phases="parse sema codegen optimize emit"
+
+# value of "key": in the compiler's --stats-json output, 0 if missing
+field() {
+	sed -n "s/^[[:space:]]*\"$1\": \([0-9.e+-]*\),*$/\1/p" "$2" | head -n 1 | grep . || echo 0
+}
+
+now() {
+	date +%s.%N
+}
+
+printf "dimension,value,wall_s,peak_rss_kib"
+for phase in $phases; do printf ",%s_s" "$phase"; done
+printf ",tokens,ir_instructions,object_bytes\n"
+
+run() {
+	dimension=$1
+	value=$2
+	shift 2
+
+	dir="$work/$dimension-$value"
+	"$bench/gen.sh" "$@" "$dir"
+
+	start=$(now)
+	(cd "$dir" && "$compiler" $opt --stats-json=stats.json < main.wh > /dev/null) || {
+		echo "compilation failed: $dimension=$value" >&2
+		return
+	}
+	end=$(now)
+
+	json="$dir/stats.json"
+	printf "%s,%s,%s,%s" "$dimension" "$value" "$(awk "BEGIN { print $end - $start }")" "$(field peak_rss_kib "$json")"
+	for phase in $phases; do printf ",%s" "$(field "$phase" "$json")"; done
+	printf ",%s,%s,%s\n" "$(field tokens "$json")" "$(field ir_instructions "$json")" "$(field object_bytes "$json")"
+}
+
+for n in $sizes; do
+	run functions $((n * 250)) -f $((n * 250))
+done
+
+for n in $sizes; do
+	run depth $((n * 500)) -f 10 -d $((n * 500))
+done
+
+for n in $sizes; do
+	run identifiers $((n * 500)) -f 10 -i $((n * 500))
+done
+
+for n in $sizes; do
+	run strings $((n * 250)) -f 10 -s $((n * 250))
+done
+
+for n in $sizes; do
+	run includes $((n * 16)) -f 512 -n $((n * 16))
+done
@@ -0,0 +1,67 @@
+#!/bin/sh
+# Generates a synthetic weirdflex program into DIR (main.wh plus include files).
+#
+#   bench/gen.sh [-f functions] [-d depth] [-i identifiers] [-s strings] [-n includes] DIR
+#
+#   -f  number of functions (default 100)
+#   -d  terms in the expression returned by each function (default 8)
+#   -i  local variables per function (default 8)
+#   -s  string literals per function (default 2)
+#   -n  include fan-out: functions are spread over this many included files (default 0)
+#
+# Every function calls the one declared before it, so the program also
+# exercises call codegen and the functions symbol table.
+functions=100
+depth=8
+identifiers=8
+strings=2
+includes=0
+
+while getopts "f:d:i:s:n:" opt; do
+	case $opt in
+	f) functions=$OPTARG ;;
+	d) depth=$OPTARG ;;
+	i) identifiers=$OPTARG ;;
+	s) strings=$OPTARG ;;
+	n) includes=$OPTARG ;;
+	*) sed -n '2,12p' "$0"; exit 1 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+dir=${1:?output directory expected}
+mkdir -p "$dir"
+rm -f "$dir"/*.wh
+
+awk -v dir="$dir" -v functions="$functions" -v depth="$depth" -v identifiers="$identifiers" \
+	-v strings="$strings" -v includes="$includes" '
+function emit(file, i,    j, term) {
+	printf "func f_%d(a int, b int) int {\n", i > file
+	for (j = 0; j < identifiers; j++)
+		printf "\tv_%d := %s + %d\n", j, (j ? "v_" (j - 1) : "a"), j > file
+	for (j = 0; j < strings; j++)
+		printf "\ts_%d := \"f_%d string literal %d: the quick brown fox jumps over the lazy dog\"\n", j, i, j > file
+	printf "\tr := a" > file
+	for (j = 1; j < depth; j++) {
+		term = identifiers ? "v_" (j % identifiers) : "b"
+		printf (j % 2 ? " + %s" : " - %s"), term > file
+	}
+	printf "\n" > file
+	if (i > 0)
+		printf "\treturn r + f_%d(a, b)\n", i - 1 > file
+	else
+		printf "\treturn r\n" > file
+	printf "}\n\n" > file
+}
+BEGIN {
+	main = dir "/main.wh"
+	files = includes + 1
+	perFile = int((functions + files - 1) / files)
+	for (k = 0; k < includes; k++)
+		printf "include \"inc_%d.wh\"\n", k > main
+	printf "\n" > main
+	for (i = 0; i < functions; i++) {
+		k = int(i / perFile)
+		emit(k < includes ? dir "/inc_" k ".wh" : main, i)
+	}
+}'
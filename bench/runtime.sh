@@ -0,0 +1,51 @@
+#!/bin/sh
+# Runtime benchmark: builds every kernel in bench/runtime twice, once with
+# weirdflex and once from its hand-written C equivalent with gcc, at each
+# optimization level. Both are linked against the same driver, which calls the
+# kernel in a loop. Prints CSV with the time ratio weirdflex/C per kernel.
+#
+#   bench/runtime.sh [compiler] > results.csv
+#
+# Environment: LEVELS (default "0 1 2 3"), ITERATIONS (default 10000000),
+# WORK is the scratch directory (default /tmp/weirdflex-runtime).
+compiler=$(realpath "${1:-./parser}")
+bench=$(dirname "$(realpath "$0")")
+std=$(realpath "$bench/../std.wh")
+runtime=$(realpath "$bench/../runtime/libwfrt.a")
+levels=${LEVELS:-0 1 2 3}
+iterations=${ITERATIONS:-10000000}
+work=${WORK:-/tmp/weirdflex-runtime}
+
+mkdir -p "$work"
+cp "$std" "$work/"
+
+echo "kernel,opt,weirdflex_s,c_s,ratio,checksum_match"
+
+for source in "$bench"/runtime/*.wh; do
+	kernel=$(basename "$source" .wh)
+	type=$(sed -n 's|^// type: *||p' "$source")
+
+	gcc -O2 -DKERNEL_TYPE="${type:-long}" -c "$bench/runtime/driver.c" -o "$work/driver-$kernel.o"
+
+	for level in $levels; do
+		(cd "$work" && "$compiler" -O"$level" < "$source" > /dev/null && mv output.o "$kernel-wh.o") || {
+			echo "weirdflex failed on $kernel -O$level" >&2
+			continue
+		}
+		gcc -O"$level" -fwrapv -c "$bench/runtime/$kernel.c" -o "$work/$kernel-c.o"
+
+		gcc "$work/driver-$kernel.o" "$work/$kernel-wh.o" "$runtime" -o "$work/$kernel-wh"
+		gcc "$work/driver-$kernel.o" "$work/$kernel-c.o" -o "$work/$kernel-c"
+
+		set -- $("$work/$kernel-wh" "$iterations")
+		whTime=$1
+		whSum=$2
+		set -- $("$work/$kernel-c" "$iterations")
+		cTime=$1
+		cSum=$2
+
+		printf "%s,-O%s,%s,%s,%s,%s\n" "$kernel" "$level" "$whTime" "$cTime" \
+			"$(awk "BEGIN { printf \"%.2f\", $whTime / $cTime }")" \
+			"$([ "$whSum" = "$cSum" ] && echo yes || echo no)"
+	done
+done
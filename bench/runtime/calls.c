@@ -0,0 +1,19 @@
+static long _square(long x)
+{
+	return x * x;
+}
+
+static long _mix(long a, long b)
+{
+	return (a * 31) + b;
+}
+
+static long _hash(long a, long b, long c)
+{
+	return _mix(_mix(a, b), c);
+}
+
+long kernel(long n)
+{
+	return _hash(_square(n), _square(n + 1), _mix(_square(n + 2), n));
+}
@@ -0,0 +1,28 @@
+/* Calls kernel(i) for i in [0, iterations) and prints the elapsed time and a checksum.
+   Linked against either the weirdflex or the C build of the same kernel. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#ifndef KERNEL_TYPE
+#define KERNEL_TYPE long
+#endif
+
+KERNEL_TYPE kernel(KERNEL_TYPE);
+
+int main(int argc, char **argv)
+{
+	long iterations = argc > 1 ? atol(argv[1]) : 10000000;
+	KERNEL_TYPE checksum = 0;
+	struct timespec start, end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (long i = 0; i < iterations; i++)
+	{
+		checksum += kernel((KERNEL_TYPE)i);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	printf("%.6f %.17g\n", (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9, (double)checksum);
+	return 0;
+}
@@ -0,0 +1,13 @@
+static long _fib(long n)
+{
+	if (n < 2)
+	{
+		return n;
+	}
+	return _fib(n - 1) + _fib(n - 2);
+}
+
+long kernel(long n)
+{
+	return _fib(n - ((n / 12) * 12));
+}
@@ -0,0 +1,7 @@
+double kernel(double x)
+{
+	double t = x / 1000000.0;
+	double p = ((((((t * 0.5) + 1.25) * t) - 3.5) * t) + 0.125) * t;
+	double q = (t * t) + 1.0;
+	return (p / q) + ((t * 2.0) / (q + 0.5));
+}
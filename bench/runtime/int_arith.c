@@ -0,0 +1,8 @@
+long kernel(long n)
+{
+	long a = n * 2654435761;
+	long b = (a / 7) + (n * 31);
+	long c = ((a - b) * (b + 3)) / 5;
+	long d = (c * c) - (a * 17);
+	return (a + (b * c)) - ((d / 3) * (a - 11));
+}
@@ -0,0 +1,40 @@
+#include <stdlib.h>
+#include <string.h>
+
+struct string
+{
+	const char *data;
+	size_t length;
+};
+
+static struct string _word(long n)
+{
+	static const struct string words[] = {{"alpha", 5}, {"beta", 4}, {"gamma", 5}, {"delta", 5}};
+	return words[n - ((n / 4) * 4)];
+}
+
+/* the lowering of a chain of string +: lengths added up, one allocation, each operand copied once */
+long kernel(long n)
+{
+	struct string comma = {", ", 2};
+	struct string parts[] = {_word(n), comma, _word(n + 1), comma, _word(n + 2), comma, _word(n + 3)};
+	size_t count = sizeof(parts) / sizeof(parts[0]);
+
+	size_t length = 0;
+	for (size_t i = 0; i < count; i++)
+	{
+		length += parts[i].length;
+	}
+
+	char *s = malloc(length + 1);
+	char *p = s;
+	for (size_t i = 0; i < count; i++)
+	{
+		memcpy(p, parts[i].data, parts[i].length);
+		p += parts[i].length;
+	}
+	*p = 0;
+
+	free(s);
+	return (long)length + n;
+}
@@ -0,0 +1,283 @@
+#include "cache.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <utime.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Config/llvm-config.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/MD5.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/SHA1.h>
+
+#include "codegen.hpp"
+#include "module.hpp"
+
+using namespace llvm;
+
+const std::string &compilerId()
+{
+	static const std::string id = [] {
+		// any relink changes the executable, whichever of its sources changed
+		auto path = sys::fs::getMainExecutable(nullptr, (void *)&compilerId);
+		auto executable = MemoryBuffer::getFile(path, -1, false);
+		if (!executable)
+		{
+			return std::string("weirdflex " __DATE__ " " __TIME__ " LLVM " LLVM_VERSION_STRING);
+		}
+
+		MD5 hash;
+		hash.update((*executable)->getBuffer());
+		MD5::MD5Result result;
+		hash.final(result);
+		return "weirdflex " + result.digest().str().str() + " LLVM " LLVM_VERSION_STRING;
+	}();
+
+	return id;
+}
+
+static bool readFile(const std::string &name, std::string &contents)
+{
+	std::ifstream file(name, std::ios::binary);
+	if (!file)
+	{
+		return false;
+	}
+
+	std::ostringstream buffer;
+	buffer << file.rdbuf();
+	contents = buffer.str();
+	return true;
+}
+
+static void hashField(SHA1 &hash, StringRef field)
+{
+	// length-prefixed so that adjacent fields cannot run into each other
+	hash.update(std::to_string(field.size()) + ':');
+	hash.update(field);
+}
+
+// Hashes the name and contents of every file pulled in by 'include', in the order the lexer
+// opens them. Skips comments and string literals the same way tokens.l does.
+static bool hashIncludes(SHA1 &hash, StringRef source, unsigned depth)
+{
+	if (depth > 64)
+	{
+		return false; // the lexer would never finish either
+	}
+
+	for (size_t i = 0; i < source.size();)
+	{
+		if (source.substr(i).startswith("//"))
+		{
+			i = source.find('\n', i);
+		}
+		else if (source.substr(i).startswith("/*"))
+		{
+			i = source.find("*/", i + 2);
+			i = i == StringRef::npos ? i : i + 2;
+		}
+		else if (source[i] == '"')
+		{
+			for (i++; i < source.size() && source[i] != '"'; i++)
+			{
+				i += source[i] == '\\';
+			}
+
+			i++;
+		}
+		else if (isalpha(source[i]) || source[i] == '_')
+		{
+			auto start = i;
+			while (i < source.size() && (isalnum(source[i]) || source[i] == '_'))
+			{
+				i++;
+			}
+
+			if (source.slice(start, i) != "include")
+			{
+				continue;
+			}
+
+			while (i < source.size() && (source[i] == ' ' || source[i] == '\t'))
+			{
+				i++;
+			}
+
+			auto end = source.find('"', i + 1);
+			if (i >= source.size() || source[i] != '"' || end == StringRef::npos)
+			{
+				continue;
+			}
+
+			auto name = source.slice(i + 1, end).str();
+			i = end + 1;
+
+			// the module the lexer will load instead, if any, is what the object is built from
+			auto module = moduleFor(name);
+			if (!module.empty())
+			{
+				name = module;
+			}
+
+			std::string contents;
+			if (!readFile(name, contents))
+			{
+				return false;
+			}
+
+			hashField(hash, name);
+			hashField(hash, contents);
+
+			if (module.empty() && !hashIncludes(hash, contents, depth + 1))
+			{
+				return false;
+			}
+		}
+		else
+		{
+			i++;
+		}
+	}
+
+	return true;
+}
+
+std::optional<std::string> ObjectCache::key(std::string_view source, const CodeGenOptions &options) const
+{
+	SHA1 hash;
+	hashField(hash, compilerId());
+	hashField(hash, sys::getDefaultTargetTriple());
+	hashField(hash, std::to_string(options.optLevel) + '.' + std::to_string(options.sizeLevel) + (options.directSSA ? ".ssa" : "") + (options.boundsChecks ? "" : ".unchecked"));
+	hashField(hash, options.cpu);
+	hashField(hash, options.features);
+
+	if (options.cpu == "native")
+	{
+		// -mcpu=native means something else on every machine sharing the cache
+		hashField(hash, sys::getHostCPUName());
+
+		StringMap<bool> hostFeatures;
+		sys::getHostCPUFeatures(hostFeatures);
+
+		std::vector<std::string> features;
+		for (auto &feature : hostFeatures)
+		{
+			features.push_back((feature.second ? "+" : "-") + feature.first().str());
+		}
+
+		std::sort(features.begin(), features.end());
+		hashField(hash, join(features, ","));
+	}
+
+	StringRef text(source.data(), source.size());
+	hashField(hash, text);
+	if (!hashIncludes(hash, text, 0))
+	{
+		return {};
+	}
+
+	return toHex(hash.final(), true);
+}
+
+std::string ObjectCache::pathOf(const std::string &key) const
+{
+	return dir + '/' + key.substr(0, 2) + '/' + key + ".o";
+}
+
+bool ObjectCache::fetch(const std::string &key, const std::string &output) const
+{
+	auto cached = pathOf(key);
+	if (!sys::fs::exists(cached))
+	{
+		return false;
+	}
+
+	sys::fs::remove(output);
+	if (sys::fs::create_hard_link(cached, output) && sys::fs::copy_file(cached, output))
+	{
+		return false;
+	}
+
+	utime(cached.c_str(), nullptr); // mark as recently used
+	return true;
+}
+
+void ObjectCache::store(const std::string &key, const std::string &output) const
+{
+	auto cached = pathOf(key);
+	if (sys::fs::create_directories(sys::path::parent_path(cached)))
+	{
+		return;
+	}
+
+	// copy under a unique name and rename, so that concurrent compilers never see a partial object
+	SmallString<128> temporary;
+	if (sys::fs::createUniqueFile(cached + ".%%%%%%", temporary) || sys::fs::copy_file(output, temporary))
+	{
+		sys::fs::remove(temporary);
+		return;
+	}
+
+	if (sys::fs::rename(temporary, cached))
+	{
+		sys::fs::remove(temporary);
+	}
+}
+
+uint64_t ObjectCache::evict() const
+{
+	struct Entry
+	{
+		std::string path;
+		uint64_t size;
+		sys::TimePoint<> used;
+	};
+
+	std::vector<Entry> entries;
+	uint64_t total = 0;
+
+	std::error_code EC;
+	for (sys::fs::recursive_directory_iterator it(dir, EC), end; it != end && !EC; it.increment(EC))
+	{
+		sys::fs::file_status status;
+		if (sys::fs::status(it->path(), status) || status.type() != sys::fs::file_type::regular_file || sys::path::extension(it->path()) != ".o")
+		{
+			continue;
+		}
+
+		entries.push_back(Entry{path : it->path(), size : status.getSize(), used : status.getLastModificationTime()});
+		total += status.getSize();
+	}
+
+	if (total <= maxBytes)
+	{
+		return 0;
+	}
+
+	std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) { return a.used < b.used; });
+
+	// trim to 90% of the limit, so that the next few stores do not have to evict again
+	uint64_t removed = 0;
+	for (auto &entry : entries)
+	{
+		if (total <= maxBytes / 10 * 9)
+		{
+			break;
+		}
+
+		if (!sys::fs::remove(entry.path))
+		{
+			total -= entry.size;
+			removed++;
+		}
+	}
+
+	return removed;
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+
+struct CodeGenOptions;
+
+// Identifies the compiler build by an MD5 of the running executable, computed on first use
+const std::string &compilerId();
+
+// On-disk cache of object files, content-addressed by a hash of everything that
+// determines the object: the source and all of its includes, the compiler build,
+// the target triple and the code generation options. Entries are touched on every
+// hit, so evicting the oldest modification times first is LRU.
+struct ObjectCache
+{
+	std::string dir;
+	uint64_t maxBytes = 512ull << 20;
+
+	// Returns nothing when the program cannot be keyed (an include is missing), it is then compiled as usual
+	std::optional<std::string> key(std::string_view source, const CodeGenOptions &options) const;
+
+	// Hard-links (or copies) the cached object to output; false on a miss
+	bool fetch(const std::string &key, const std::string &output) const;
+	void store(const std::string &key, const std::string &output) const;
+
+	// Removes least recently used entries until the cache fits in maxBytes; returns the number removed
+	uint64_t evict() const;
+
+private:
+	std::string pathOf(const std::string &key) const;
+};
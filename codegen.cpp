@@ -4,72 +4,329 @@
 #include <llvm/IR/Instructions.h>
 #include <llvm/IR/LegacyPassManager.h>
 #include <llvm/IR/IRPrintingPasses.h>
+#include <llvm/Analysis/TargetLibraryInfo.h>
+#include <llvm/Analysis/TargetTransformInfo.h>
+#include <llvm/CodeGen/ParallelCG.h>
 #include <llvm/ExecutionEngine/ExecutionEngine.h>
+#include <llvm/ExecutionEngine/Orc/ExecutionUtils.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/Linker/Linker.h>
+#include <llvm/MC/SubtargetFeature.h>
 #include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
 #include "llvm/Support/Host.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/TargetRegistry.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Target/TargetOptions.h"
+#include "llvm/Transforms/Coroutines.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/IPO/AlwaysInliner.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Transforms/Scalar.h"
+#include <mutex>
 #include <unistd.h>
 
 #include "node.hpp"
+#include "sema.hpp"
 
 using namespace Node;
 using namespace llvm;
 using namespace std::literals;
 
-CodeGenContext::CodeGenContext()
+#ifndef WEIRDFLEX_RUNTIME // set by the Makefile
+#define WEIRDFLEX_RUNTIME "runtime/libwfrt.a"
+#endif
+
+CodeGenContext::CodeGenContext(const CodeGenOptions &options) : options(options)
 {
-	module = llvm::make_unique<Module>("main module", GlobalContext);
+	llvmContext = llvm::make_unique<LLVMContext>();
+	module = llvm::make_unique<Module>("main module", *llvmContext);
 
-	// Initialize the target registry etc.
-	InitializeAllTargetInfos();
-	InitializeAllTargets();
-	InitializeAllTargetMCs();
-	InitializeAllAsmParsers();
-	InitializeAllAsmPrinters();
+	// Initialize the target registry etc. (process-wide, contexts may be created on several threads)
+	static std::once_flag targetsInitialized;
+	std::call_once(targetsInitialized, [] {
+		InitializeAllTargetInfos();
+		InitializeAllTargets();
+		InitializeAllTargetMCs();
+		InitializeAllAsmParsers();
+		InitializeAllAsmPrinters();
+	});
 }
 
+CodeGenContext::~CodeGenContext() = default;
+
 void CodeGenContext::generateCode(Node::Block &root)
 {
-	std::cout << "Generating code...\n";
+	if (options.verbose)
+	{
+		std::cout << "Generating code...\n";
+	}
+
+	for (auto stmt : root.stmts)
+	{
+		generateTopLevel(*stmt);
+	}
+
+	finishCode();
+}
+
+void CodeGenContext::generateTopLevel(Statement &stmt)
+{
+	if (!sema)
+	{
+		sema = llvm::make_unique<Sema>();
+	}
+
+	{
+		PhaseTimer timer(stats, "sema");
+		sema->resolveTopLevel(stmt);
+	}
+
+	PhaseTimer timer(stats, "codegen");
+	stmt.codeGen(*this);
+}
+
+// Functions of precompiled modules are linkonce_odr, so they would be dropped from an object
+// that does not call them; weak_odr keeps them for the objects written before this one
+static void linkImports(Module &module, std::vector<std::unique_ptr<Module>> &imports, bool keepAll)
+{
+	for (auto &import : imports)
+	{
+		for (auto &function : *import)
+		{
+			if (keepAll && function.hasLinkOnceODRLinkage())
+			{
+				function.setLinkage(GlobalValue::WeakODRLinkage);
+			}
+		}
+
+		if (Linker::linkModules(module, std::move(import)))
+		{
+			throw std::runtime_error("cannot link precompiled module");
+		}
+	}
+
+	imports.clear();
+}
+
+void CodeGenContext::finishCode()
+{
+	if (!imports.empty())
+	{
+		PhaseTimer timer(stats, "link");
+		linkImports(*module, imports, objectParts > 0);
+	}
+
+	stats.add("ir_functions", module->getFunctionList().size());
+	stats.add("ir_instructions", instructionCount());
 
-	root.codeGen(*this);
+	if (!options.verbose)
+	{
+		return;
+	}
 
 	std::cout << "Code is generated.\n";
 
 	/* Print the bytecode in a human-readable format 
 	   to see if our program compiled properly
 	 */
+	PhaseTimer timer(stats, "print");
 	legacy::PassManager pm;
 	pm.add(createPrintModulePass(outs()));
 	pm.run(*module);
 }
 
-void CodeGenContext::buildObject(const std::string &filename)
+// Streaming mode: rebinds calls to function to a copy of its signature, before the AST of the function is freed
+void CodeGenContext::forget(const FunctionDeclaration &function, const FunctionDeclaration &signature)
 {
-	auto targetTriple = sys::getDefaultTargetTriple();
-	module->setTargetTriple(targetTriple);
+	sema->functions[function.id->symbol] = &signature;
+	functions[function.id->symbol].node = dynamic_cast<const Expression *>(&signature);
+}
 
+uint64_t CodeGenContext::instructionCount() const
+{
+	uint64_t count = 0;
+	for (auto &function : *module)
+	{
+		count += function.getInstructionCount();
+	}
+
+	return count;
+}
+
+static CodeGenOpt::Level codeGenOptLevel(unsigned optLevel)
+{
+	switch (optLevel)
+	{
+	case 0:
+		return CodeGenOpt::None;
+	case 1:
+		return CodeGenOpt::Less;
+	case 2:
+		return CodeGenOpt::Default;
+	default:
+		return CodeGenOpt::Aggressive;
+	}
+}
+
+// Expands -mcpu=native into the host CPU name and feature set; explicit -mattr features are applied on top
+static std::pair<std::string, std::string> resolveCPU(const std::string &cpu, const std::string &features)
+{
+	if (cpu != "native")
+	{
+		return {cpu, features};
+	}
+
+	SubtargetFeatures resolved;
+	StringMap<bool> hostFeatures;
+	if (sys::getHostCPUFeatures(hostFeatures))
+	{
+		for (auto &feature : hostFeatures)
+		{
+			resolved.AddFeature(feature.first(), feature.second);
+		}
+	}
+
+	for (auto &feature : SubtargetFeatures(features).getFeatures())
+	{
+		resolved.AddFeature(feature);
+	}
+
+	return {sys::getHostCPUName().str(), resolved.getString()};
+}
+
+// Creates a target machine for the given triple without touching any module, so it can be called from the split code generator's threads
+static std::unique_ptr<TargetMachine> makeTargetMachine(const CodeGenOptions &options, const std::string &targetTriple)
+{
 	std::string Error;
 	auto target = TargetRegistry::lookupTarget(targetTriple, Error);
 
 	if (!target)
 	{
 		errs() << Error;
-		return;
+		return nullptr;
 	}
 
-	auto CPU = "generic";
-	auto Features = "";
+	auto [CPU, Features] = resolveCPU(options.cpu.empty() ? "generic" : options.cpu, options.features);
 
 	TargetOptions opt;
 	auto RM = Optional<Reloc::Model>(Reloc::Model::PIC_);
-	auto targetMachine = target->createTargetMachine(targetTriple, CPU, Features, opt, RM);
+	return std::unique_ptr<TargetMachine>(target->createTargetMachine(targetTriple, CPU, Features, opt, RM, None, codeGenOptLevel(options.optLevel)));
+}
 
-	module->setDataLayout(targetMachine->createDataLayout());
+std::unique_ptr<TargetMachine> CodeGenContext::createTargetMachine()
+{
+	auto targetTriple = sys::getDefaultTargetTriple();
+	module->setTargetTriple(targetTriple);
+
+	auto targetMachine = makeTargetMachine(options, targetTriple);
+	if (targetMachine)
+	{
+		module->setDataLayout(targetMachine->createDataLayout());
+	}
+
+	return targetMachine;
+}
+
+void CodeGenContext::optimize(TargetMachine &targetMachine)
+{
+	PhaseTimer timer(stats, "optimize");
+
+	// let the IR-level passes (vectorizers, TTI cost model) see the real target
+	for (auto &function : *module)
+	{
+		if (function.isDeclaration())
+		{
+			continue;
+		}
+
+		function.addFnAttr("target-cpu", targetMachine.getTargetCPU());
+		if (!targetMachine.getTargetFeatureString().empty())
+		{
+			function.addFnAttr("target-features", targetMachine.getTargetFeatureString());
+		}
+	}
+
+	PassManagerBuilder builder;
+	builder.OptLevel = options.optLevel;
+	builder.SizeLevel = options.sizeLevel;
+	builder.LibraryInfo = new TargetLibraryInfoImpl(Triple(module->getTargetTriple()));
+
+	if (options.optLevel > 0)
+	{
+		// same thresholds clang uses for -O1..-O3 and -Os/-Oz
+		builder.Inliner = createFunctionInliningPass(options.optLevel, options.sizeLevel, false);
+	}
+	else
+	{
+		builder.Inliner = createAlwaysInlinerLegacyPass();
+	}
+
+	if (options.optLevel > 1 && options.boundsChecks)
+	{
+		// splits loops into a range where no bounds check can fail and pre/post loops that keep them
+		builder.addExtension(PassManagerBuilder::EP_LoopOptimizerEnd, [](const PassManagerBuilder &, legacy::PassManagerBase &pm) {
+			pm.add(createInductiveRangeCheckEliminationPass());
+		});
+	}
+
+	// async functions are split into their resume and destroy parts at every level, at -O1 and up after
+	// inlining so that a task awaited where it is called keeps its frame in the caller's (CoroElide)
+	addCoroutinePassesToExtensionPoints(builder);
+
+	builder.LoopVectorize = options.optLevel > 1 && options.sizeLevel < 2;
+	builder.SLPVectorize = options.optLevel > 1 && options.sizeLevel < 2;
+
+	targetMachine.adjustPassManager(builder);
+
+	legacy::FunctionPassManager fpm(module.get());
+	fpm.add(createTargetTransformInfoWrapperPass(targetMachine.getTargetIRAnalysis()));
+	builder.populateFunctionPassManager(fpm);
+
+	legacy::PassManager mpm;
+	mpm.add(createTargetTransformInfoWrapperPass(targetMachine.getTargetIRAnalysis()));
+	builder.populateModulePassManager(mpm);
+
+	fpm.doInitialization();
+	for (auto &function : *module)
+	{
+		fpm.run(function);
+	}
+	fpm.doFinalization();
+
+	mpm.run(*module);
+
+	stats.add("ir_instructions_optimized", instructionCount());
+}
+
+// output.o -> output.<index>.o
+static std::string partName(const std::string &filename, unsigned index)
+{
+	auto dot = filename.rfind('.');
+	if (dot == std::string::npos || filename.find('/', dot) != std::string::npos)
+	{
+		return filename + '.' + std::to_string(index);
+	}
+
+	return filename.substr(0, dot) + '.' + std::to_string(index) + filename.substr(dot);
+}
+
+bool CodeGenContext::buildObject(const std::string &filename)
+{
+	auto targetMachine = createTargetMachine();
+	if (!targetMachine)
+	{
+		return false;
+	}
+
+	optimize(*targetMachine);
+
+	if (options.splitParts > 1)
+	{
+		return buildSplitObjects(filename);
+	}
 
 	std::error_code EC;
 	raw_fd_ostream dest(filename, EC, sys::fs::F_None);
@@ -77,7 +334,7 @@ void CodeGenContext::buildObject(const std::string &filename)
 	if (EC)
 	{
 		errs() << "Could not open file: " << EC.message();
-		return;
+		return false;
 	}
 
 	legacy::PassManager pass;
@@ -89,13 +346,166 @@ void CodeGenContext::buildObject(const std::string &filename)
 #endif
 	{
 		errs() << "TheTargetMachine can't emit a file of this type";
-		return;
+		return false;
+	}
+
+	{
+		PhaseTimer timer(stats, "emit");
+		pass.run(*module);
+		dest.flush();
+	}
+
+	stats.add("object_bytes", dest.tell());
+
+	if (options.verbose)
+	{
+		outs() << module->getTargetTriple() << ": Wrote " << filename << " (" << dest.tell() << " bytes)\n";
+	}
+
+	return true;
+}
+
+// Partitions the optimized module by function and runs instruction selection and MC on each
+// partition on its own thread, writing one object per partition (all of them must be linked).
+// Locals stay in the partition that uses them, so no symbols are added to the objects.
+// The module is consumed.
+bool CodeGenContext::buildSplitObjects(const std::string &filename)
+{
+	std::vector<std::unique_ptr<raw_fd_ostream>> files;
+	std::vector<raw_pwrite_stream *> streams;
+	for (unsigned i = 0; i < options.splitParts; i++)
+	{
+		std::error_code EC;
+		files.push_back(llvm::make_unique<raw_fd_ostream>(partName(filename, i), EC, sys::fs::F_None));
+
+		if (EC)
+		{
+			errs() << "Could not open file: " << EC.message();
+			return false;
+		}
+
+		streams.push_back(files.back().get());
+	}
+
+	auto triple = module->getTargetTriple();
+	{
+		PhaseTimer timer(stats, "emit");
+		module = splitCodeGen(
+			std::move(module), streams, {}, [&] { return makeTargetMachine(options, triple); }, TargetMachine::CGFT_ObjectFile, true);
+	}
+
+	uint64_t bytes = 0;
+	for (unsigned i = 0; i < files.size(); i++)
+	{
+		files[i]->flush();
+		bytes += files[i]->tell();
+
+		if (options.verbose)
+		{
+			outs() << triple << ": Wrote " << partName(filename, i) << " (" << files[i]->tell() << " bytes)\n";
+		}
+	}
+
+	stats.add("object_bytes", bytes);
+	stats.add("object_parts", files.size());
+
+	return true;
+}
+
+// Streaming mode: writes the functions generated so far to the next <name>.<part>.o and continues in
+// a fresh module, so that the IR of a huge program is never resident at once. Every part must be linked.
+bool CodeGenContext::flushObject(const std::string &filename)
+{
+	stats.add("ir_functions", module->getFunctionList().size());
+	stats.add("ir_instructions", instructionCount());
+
+	if (!imports.empty())
+	{
+		PhaseTimer timer(stats, "link");
+		linkImports(*module, imports, true);
+	}
+
+	// later parts may call private functions of this one; the suffix keeps them apart from those of other programs
+	for (auto &slot : functions.slots)
+	{
+		auto function = slot.key ? cast<Function>(slot.value.value) : nullptr;
+		if (function && function->hasLocalLinkage())
+		{
+			function->setLinkage(GlobalValue::ExternalLinkage);
+			function->setVisibility(GlobalValue::HiddenVisibility);
+			function->setName(function->getName() + "." + sys::path::stem(filename));
+		}
 	}
 
-	pass.run(*module);
-	dest.flush();
+	if (!buildObject(partName(filename, objectParts++)))
+	{
+		return false;
+	}
+
+	stats.add("object_parts", 1);
+
+	auto next = llvm::make_unique<Module>("main module", *llvmContext);
+	for (auto &slot : functions.slots)
+	{
+		if (slot.key)
+		{
+			auto function = cast<Function>(slot.value.value);
+			slot.value.value = Function::Create(function->getFunctionType(), GlobalValue::ExternalLinkage, function->getName(), next.get());
+		}
+	}
+
+	module = std::move(next);
+	return true;
+}
+
+int CodeGenContext::run()
+{
+	ExitOnError exitOnErr("JIT error: ");
+
+	auto main = module->getFunction("main");
+	if (!main || main->isDeclaration())
+	{
+		errs() << "Function 'main' is not defined\n";
+		return 1;
+	}
+
+	bool returnsVoid = main->getReturnType()->isVoidTy();
+
+	auto machineBuilder = exitOnErr(orc::JITTargetMachineBuilder::detectHost());
+	machineBuilder.setCodeGenOptLevel(codeGenOptLevel(options.optLevel));
+
+	// the JIT always runs on the host, so tune for it unless told otherwise
+	auto [jitCPU, jitFeatures] = resolveCPU(options.cpu.empty() ? "native" : options.cpu, options.features);
+	machineBuilder.setCPU(jitCPU);
+	machineBuilder.getFeatures() = SubtargetFeatures(jitFeatures);
+	auto targetMachine = exitOnErr(machineBuilder.createTargetMachine());
+	module->setTargetTriple(targetMachine->getTargetTriple().str());
+	module->setDataLayout(targetMachine->createDataLayout());
+	optimize(*targetMachine);
+
+	std::unique_ptr<orc::LLJIT> jit;
+	JITTargetAddress address;
+	{
+		PhaseTimer timer(stats, "jit");
+		jit = exitOnErr(orc::LLJITBuilder().setJITTargetMachineBuilder(std::move(machineBuilder)).create());
+
+		// resolve the extern C bindings (printf, malloc...) against the host process
+		auto &dylib = jit->getMainJITDylib();
+		dylib.setGenerator(exitOnErr(orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(jit->getDataLayout().getGlobalPrefix())));
+
+		exitOnErr(jit->addIRModule(orc::ThreadSafeModule(std::move(module), orc::ThreadSafeContext(std::move(llvmContext)))));
+
+		// materializes (compiles) main and everything it references
+		address = exitOnErr(jit->lookup("main")).getAddress();
+	}
+
+	if (returnsVoid)
+	{
+		reinterpret_cast<void (*)()>(address)();
+		return 0;
+	}
 
-	outs() << targetTriple << ": Wrote " << filename << " (" << dest.tell() << " bytes)\n";
+	return static_cast<int>(reinterpret_cast<int64_t (*)()>(address)());
 }
 
 void CodeGenContext::buildExecutable(const std::string &output, const std::string &input)
@@ -103,8 +513,11 @@ void CodeGenContext::buildExecutable(const std::string &output, const std::strin
 	char *argv[] = {
 		"gcc",
 		const_cast<char *>(input.c_str()),
+		const_cast<char *>(WEIRDFLEX_RUNTIME),
+		"-pthread", // the thread pool of parallel for
 		"-o",
 		const_cast<char *>(output.c_str()),
+		nullptr,
 	};
 
 	// outs() << "trying to call gcc with " << argv[0] << ", " << argv[1] << ", " << argv[2] << '\n';
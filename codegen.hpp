@@ -1,38 +1,32 @@
 #pragma once
 #include <iostream>
 #include <map>
+#include <optional>
 #include <stack>
+#include <vector>
 #include <llvm/IR/Constants.h>
 #include <llvm/IR/Module.h>
 #include <llvm/IR/IRBuilder.h>
 
+#include "container.hpp"
+#include "ssa.hpp"
+#include "stats.hpp"
+#include "symbol.hpp"
+
+namespace llvm
+{
+class TargetMachine;
+} // namespace llvm
+
 namespace Node
 {
 struct Block;
+struct FunctionDeclaration;
 struct NodeBase;
+struct Statement;
 } // namespace Node
 
-template <typename T>
-struct Container
-{
-	std::map<std::string, T> value;
-
-	std::optional<T> find(std::string name)
-	{
-		auto it = value.find(name);
-		if (it == value.end())
-		{
-			return {};
-		}
-
-		return it->second;
-	}
-
-	T &operator[](const std::string &key)
-	{
-		return value[key];
-	}
-};
+struct Sema;
 
 struct NodeInfo
 {
@@ -40,21 +34,67 @@ struct NodeInfo
 	llvm::Value *value;
 };
 
+// Where break and continue go in an enclosing loop
+struct LoopTarget
+{
+	llvm::BasicBlock *exit; // null in the body of a parallel for, which runs on in other chunks
+	llvm::BasicBlock *latch;
+	unsigned regions; // regions open outside of the loop, the ones opened inside are left on the way out
+};
+
+// The lowering of an async function, see createCoroutineBegin
+struct Coroutine
+{
+	llvm::Value *id;
+	llvm::Value *handle;	   // its task, from llvm.coro.begin
+	llvm::AllocaInst *promise; // {i8 *continuation, i1 detached, result}, the part of the frame other tasks see
+	llvm::BasicBlock *final;   // where a return goes once the result is stored
+	llvm::BasicBlock *cleanup; // frees the frame
+	llvm::BasicBlock *suspend; // returns to whoever resumed it
+};
+
 struct CodeGenBlock
 {
 	llvm::BasicBlock *block;
 	Container<NodeInfo> args;
-	Container<NodeInfo> locals;
+	Container<NodeInfo> locals; // value is the stack slot, or null for a local kept in SSA form (--ssa)
+	SSABuilder ssa;
+	unsigned regions = 0; // region statements open at the insertion point, left again by every return
+	std::vector<LoopTarget> loops;
+	std::optional<Coroutine> coroutine; // in an async function
+};
+
+// Command line settings shared by every compilation of one invocation
+struct CodeGenOptions
+{
+	unsigned optLevel = 0;	// -O0..-O3
+	unsigned sizeLevel = 0; // -Os = 1, -Oz = 2
+	std::string cpu;		// -mcpu=, "native" for the host CPU
+	std::string features;	// -mattr=, e.g. "+avx2,-fma"
+	unsigned splitParts = 1; // --split=N, backend partitions emitted in parallel
+	bool streaming = false;	 // --stream, code generation while parsing
+	bool directSSA = false;	 // --ssa, locals become SSA values instead of stack slots
+	unsigned streamBatch = 0; // --stream=N, functions per object, 0 for a single object
+	bool boundsChecks = true; // off with --unchecked
+	bool verbose = true;	// progress messages and IR dump
 };
 
 struct CodeGenContext
 {
 	std::stack<CodeGenBlock> blocks;
 	llvm::Function *mainFunction;
+	std::unique_ptr<llvm::LLVMContext> llvmContext;
 	std::unique_ptr<llvm::Module> module;
 	Container<NodeInfo> functions;
+	std::vector<std::unique_ptr<llvm::Module>> imports; // precompiled modules, linked in after code generation
+	std::unique_ptr<Sema> sema;							// kept across top-level statements
+	unsigned objectParts = 0;							// objects written by flushObject
 
-	CodeGenContext();
+	CodeGenOptions options;
+	CompileStats stats;
+
+	CodeGenContext(const CodeGenOptions &options = {});
+	~CodeGenContext();
 
 	auto &args()
 	{
@@ -66,11 +106,22 @@ struct CodeGenContext
 		return blocks.top().locals;
 	}
 
+	auto &ssa()
+	{
+		return blocks.top().ssa;
+	}
+
 	llvm::BasicBlock *currentBlock()
 	{
 		return blocks.top().block;
 	}
 
+	// Moves code generation of the current function on to another basic block
+	void setInsertBlock(llvm::BasicBlock *block)
+	{
+		blocks.top().block = block;
+	}
+
 	void pushBlock(llvm::BasicBlock *block)
 	{
 		blocks.push(CodeGenBlock{block : block, args : {}, locals : {}});
@@ -82,6 +133,15 @@ struct CodeGenContext
 	}
 
 	void generateCode(Node::Block &root);
-	void buildObject(const std::string &filename);
+	void generateTopLevel(Node::Statement &stmt);
+	void finishCode();
+	void forget(const Node::FunctionDeclaration &function, const Node::FunctionDeclaration &signature);
+	bool flushObject(const std::string &filename);
+	uint64_t instructionCount() const;
+	std::unique_ptr<llvm::TargetMachine> createTargetMachine();
+	void optimize(llvm::TargetMachine &targetMachine);
+	bool buildObject(const std::string &filename);
+	bool buildSplitObjects(const std::string &filename);
+	int run();
 	void buildExecutable(const std::string &output, const std::string &input);
 };
\ No newline at end of file
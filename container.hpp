@@ -0,0 +1,84 @@
+#pragma once
+#include <optional>
+#include <vector>
+
+#include "symbol.hpp"
+
+// Open-addressing hash map keyed by interned symbols, with linear probing.
+// Symbol ids are dense, so a multiplicative hash spreads them well enough.
+template <typename T>
+struct Container
+{
+	struct Slot
+	{
+		Symbol key; // Symbols::Empty marks a free slot
+		T value;
+	};
+
+	std::vector<Slot> slots;
+	size_t count = 0;
+
+	std::optional<T> find(Symbol key) const
+	{
+		if (slots.empty())
+		{
+			return {};
+		}
+
+		for (auto i = slotOf(key);; i = (i + 1) & (slots.size() - 1))
+		{
+			if (slots[i].key == key)
+			{
+				return slots[i].value;
+			}
+
+			if (!slots[i].key)
+			{
+				return {};
+			}
+		}
+	}
+
+	T &operator[](Symbol key)
+	{
+		if ((count + 1) * 4 > slots.size() * 3)
+		{
+			rehash(slots.empty() ? 16 : slots.size() * 2);
+		}
+
+		auto i = slotOf(key);
+		while (slots[i].key && slots[i].key != key)
+		{
+			i = (i + 1) & (slots.size() - 1);
+		}
+
+		if (!slots[i].key)
+		{
+			slots[i].key = key;
+			count++;
+		}
+
+		return slots[i].value;
+	}
+
+private:
+	size_t slotOf(Symbol key) const
+	{
+		return (key.id * 2654435769u) & (slots.size() - 1);
+	}
+
+	void rehash(size_t size)
+	{
+		auto old = std::move(slots);
+		slots = std::vector<Slot>(size);
+		count = 0;
+
+		for (auto &slot : old)
+		{
+			if (slot.key)
+			{
+				(*this)[slot.key] = std::move(slot.value);
+			}
+		}
+	}
+};
@@ -1,27 +1,42 @@
 #pragma once
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
 #include <string>
-#include <tuple>
+
+#include "module.hpp"
+#include "parsestate.hpp"
 
 #ifdef _DEBUG
-#define WITH_LOG(t) (printf("token '%s', value '%s'\n", #t, yytext), t)
+#define WITH_LOG(t) (yyextra->tokenCount++, printf("token '%s', value '%s'\n", #t, yytext), t)
 #else
-#define WITH_LOG(t) (t)
+#define WITH_LOG(t) (yyextra->tokenCount++, t)
 #endif
 
-#define SAVE_TOKEN (yylval.string = new std::string(yytext, yyleng))
-#define TOKEN(t) (yylval.token = t)
-extern "C" int yywrap() { return 1; }
+#define SAVE_TOKEN (yylval->string = TokenText{yytext, size_t(yyleng)})
+#define TOKEN(t) (yylval->token = t)
 extern "C" void yyterminate();
 
-auto unescape(const std::string &s)
+// Resolves the escapes of a string literal. The literal is returned as is, without
+// copying, unless it contains a backslash; only then is the text rebuilt in the arena.
+bool unescape(const char *text, size_t length, Arena &arena, TokenText &result)
 {
-    std::string res;
-    res.reserve(s.size());
+    auto end = text + length;
+    auto escape = static_cast<const char *>(memchr(text, '\\', length));
+    if (!escape)
+    {
+        result = TokenText{text, length};
+        return true;
+    }
+
+    auto res = static_cast<char *>(arena.allocate(length, 1));
+    auto out = std::copy(text, escape, res);
 
-    for (auto it = s.begin(); it != s.end();)
+    for (auto it = escape; it != end;)
     {
         char c = *it++;
-        if (c == '\\' && it != s.end())
+        if (c == '\\' && it != end)
         {
             switch (auto next = *it++)
             {
@@ -60,11 +75,12 @@ auto unescape(const std::string &s)
                 break;
             default:
                 printf("Unknown escape sequence: '\\%c'\n", next);
-                return std::make_tuple(res, false);
+                return false;
             }
         }
-        res += c;
+        *out++ = c;
     }
 
-    return std::make_tuple(res, true);
+    result = TokenText{res, size_t(out - res)};
+    return true;
 }
\ No newline at end of file
@@ -1,12 +1,21 @@
+#include <atomic>
 #include <iostream>
+#include <thread>
+#include <vector>
+#include <sys/resource.h>
+#include <llvm/Pass.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/raw_ostream.h>
+#include "cache.hpp"
 #include "codegen.hpp"
+#include "module.hpp"
 #include "node.hpp"
+#include "parsestate.hpp"
 
+using namespace Node;
 using namespace std;
 
-extern int yyparse();
-extern Node::Block *programBlock;
-
 extern int yydebug;
 
 std::string tmpname()
@@ -25,23 +34,500 @@ std::string tmpname()
 	return objname;
 }
 
+long peakRSS()
+{
+	rusage usage{};
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss; // KiB on Linux
+}
+
+// Returns the cache key of the program, or nothing if the cache is off or the program cannot be cached
+std::optional<std::string> cacheKey(const ObjectCache *cache, std::string_view source, const CodeGenOptions &options, CompileStats &stats)
+{
+	if (!cache || options.splitParts > 1 || options.streamBatch)
+	{
+		return {};
+	}
+
+	PhaseTimer timer(stats, "cache");
+	return cache->key(source, options);
+}
+
+// Copies the declaration part of a function into arena, so that calls in later
+// functions still resolve once the AST of the function has been freed
+FunctionDeclaration *retainSignature(const FunctionDeclaration &function, Arena &arena)
+{
+	auto args = arena.make<ArgumentList>();
+	args->variadic = function.args.variadic;
+	for (auto arg : function.args)
+	{
+		args->push_back(arena.make<VariableDeclaration>(arena.make<Identifier>(*arg->type), nullptr, nullptr));
+	}
+
+	auto type = function.type ? arena.make<Identifier>(*function.type) : nullptr;
+	auto signature = arena.make<FunctionDeclaration>(type, arena.make<Identifier>(*function.id), *args, nullptr, function.external, function.async);
+	signature->resolvedType = function.resolvedType;
+	return signature;
+}
+
+// Parses the program and generates its code; false on a parse error. With --stream the code of each
+// top-level statement is generated as soon as it is parsed and its AST is freed right away, and with
+// --stream=N every N functions are written to an object of their own (see flushObject), so neither
+// the AST nor the IR of the whole program is ever resident.
+bool generate(std::unique_ptr<SourceBuffer> source, ParseState &parseState, CodeGenContext &context, const std::string &objname)
+{
+	auto &options = context.options;
+	if (options.streaming)
+	{
+		unsigned functions = 0;
+		parseState.onTopLevel = [&](Statement &stmt) {
+			for (auto declaration : importModules(context, parseState))
+			{
+				context.generateTopLevel(*declaration);
+			}
+
+			context.generateTopLevel(stmt);
+
+			auto function = dynamic_cast<FunctionDeclaration *>(&stmt);
+			if (!function || !function->id)
+			{
+				return;
+			}
+
+			context.forget(*function, *retainSignature(*function, parseState.retained));
+
+			if (options.streamBatch && function->block && ++functions % options.streamBatch == 0 && !context.flushObject(objname))
+			{
+				throw runtime_error("cannot write " + objname);
+			}
+		};
+	}
+
+	{
+		PhaseTimer timer(context.stats, "parse"); // includes sema and codegen when streaming
+		if (parse(std::move(source), parseState))
+		{
+			return false;
+		}
+	}
+
+	auto declarations = importModules(context, parseState);
+	if (options.streaming)
+	{
+		for (auto declaration : declarations)
+		{
+			context.generateTopLevel(*declaration);
+		}
+
+		if (!options.streamBatch) // the last part is finished by writeObject
+		{
+			context.finishCode();
+		}
+	}
+	else
+	{
+		auto &stmts = parseState.programBlock->stmts;
+		stmts.insert(stmts.begin(), declarations.begin(), declarations.end());
+		context.generateCode(*parseState.programBlock);
+	}
+
+	context.stats.count("tokens", parseState.tokenCount);
+	context.stats.count("ast_allocations", parseState.arena.allocationCount());
+	context.stats.count("ast_bytes", parseState.arena.bytesAllocated());
+	return true;
+}
+
+// Writes the object, or with --stream=N its last part
+bool writeObject(CodeGenContext &context, const std::string &objname)
+{
+	return context.options.streamBatch ? context.flushObject(objname) : context.buildObject(objname);
+}
+
+struct ReportOptions
+{
+	bool timeReport = false;
+	bool stats = false;
+	std::string jsonFile;
+};
+
+void report(CompileStats &stats, const ReportOptions &options)
+{
+	stats.count("peak_rss_kib", peakRSS());
+
+	if (options.timeReport)
+	{
+		stats.printPhases(llvm::errs());
+	}
+
+	if (options.stats)
+	{
+		stats.printCounters(llvm::errs());
+	}
+
+	if (!options.jsonFile.empty())
+	{
+		std::error_code EC;
+		llvm::raw_fd_ostream json(options.jsonFile, EC, llvm::sys::fs::F_None);
+		if (EC)
+		{
+			cerr << "Could not open file: " << EC.message() << '\n';
+			return;
+		}
+
+		stats.printJSON(json, options.timeReport);
+	}
+}
+
+// One input file of a multi-file build
+struct Job
+{
+	std::string input;
+	std::string output;
+	bool ok = false;
+	std::string log; // printed in input order once every job is done
+	CompileStats stats;
+};
+
+void compile(Job &job, const CodeGenOptions &options, const ObjectCache *cache)
+{
+	llvm::raw_string_ostream log(job.log);
+
+	auto source = SourceBuffer::map(job.input.c_str());
+	if (!source)
+	{
+		log << job.input << ": cannot open file\n";
+		return;
+	}
+
+	CodeGenContext context(options);
+	ParseState parseState;
+
+	auto key = cacheKey(cache, source->text(), options, context.stats);
+	if (key && cache->fetch(*key, job.output))
+	{
+		context.stats.count("cache_hits", 1);
+		log << job.input << " -> " << job.output << " (cached)\n";
+		job.ok = true;
+		job.stats = std::move(context.stats);
+		return;
+	}
+
+	try
+	{
+		if (!generate(std::move(source), parseState, context, job.output))
+		{
+			log << job.input << ": parse failed\n";
+			return;
+		}
+
+		parseState.arena.release();
+
+		if (key)
+		{
+			// the output may be a hard link into the cache, never write through it
+			llvm::sys::fs::remove(job.output);
+		}
+
+		job.ok = writeObject(context, job.output);
+	}
+	catch (const std::exception &e)
+	{
+		log << job.input << ": " << e.what() << '\n';
+	}
+
+	if (job.ok)
+	{
+		log << job.input << " -> " << job.output << '\n';
+	}
+
+	if (job.ok && key)
+	{
+		context.stats.count("cache_misses", 1);
+		cache->store(*key, job.output);
+	}
+
+	job.stats = std::move(context.stats);
+}
+
+// Compiles every input into its own object in outputDir on a pool of worker threads
+int compileAll(const std::vector<std::string> &inputs, const std::string &outputDir, unsigned threads, const CodeGenOptions &options, const ObjectCache *cache, const ReportOptions &reportOptions)
+{
+	std::vector<Job> jobs(inputs.size());
+	for (size_t i = 0; i < inputs.size(); i++)
+	{
+		auto name = llvm::sys::path::stem(inputs[i]).str();
+		jobs[i].input = inputs[i];
+		jobs[i].output = outputDir + '/' + name + ".o";
+
+		for (size_t j = 0; j < i; j++)
+		{
+			if (jobs[j].output == jobs[i].output)
+			{
+				cerr << inputs[j] << " and " << inputs[i] << " would both be compiled to " << jobs[i].output << '\n';
+				return 1;
+			}
+		}
+	}
+
+	if (auto EC = llvm::sys::fs::create_directories(outputDir))
+	{
+		cerr << "Could not create " << outputDir << ": " << EC.message() << '\n';
+		return 1;
+	}
+
+	std::atomic<size_t> next{0};
+	std::vector<std::thread> workers;
+	for (unsigned t = 0; t < std::min<size_t>(threads, jobs.size()); t++)
+	{
+		workers.emplace_back([&] {
+			for (size_t i; (i = next++) < jobs.size();)
+			{
+				compile(jobs[i], options, cache);
+			}
+		});
+	}
+
+	for (auto &worker : workers)
+	{
+		worker.join();
+	}
+
+	int failed = 0;
+	CompileStats total;
+	for (auto &job : jobs)
+	{
+		cout << job.log;
+		failed += !job.ok;
+		total.merge(job.stats);
+	}
+
+	if (cache)
+	{
+		total.count("cache_evictions", cache->evict());
+	}
+
+	report(total, reportOptions);
+
+	if (failed)
+	{
+		cerr << failed << " of " << jobs.size() << " files failed to compile\n";
+		return 1;
+	}
+
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
 #ifdef _DEBUG
 	yydebug = 1;
 #endif
 
-	if (yyparse())
+	CodeGenOptions options;
+	bool jit = false;
+	bool memStats = false;
+	ReportOptions reportOptions;
+	std::vector<std::string> inputs;
+	std::string outputDir = ".";
+	unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+	ObjectCache cache;
+	std::string moduleFile;
+
+	if (auto dir = getenv("WEIRDFLEX_CACHE_DIR"))
 	{
+		cache.dir = dir;
+	}
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+
+		if (arg == "run" && i == 1)
+		{
+			jit = true;
+			options.verbose = false;
+		}
+		else if (arg == "-Os" || arg == "-Oz")
+		{
+			options.optLevel = 2;
+			options.sizeLevel = arg == "-Os" ? 1 : 2;
+		}
+		else if (arg.size() == 3 && arg.compare(0, 2, "-O") == 0 && arg[2] >= '0' && arg[2] <= '3')
+		{
+			options.optLevel = arg[2] - '0';
+			options.sizeLevel = 0;
+		}
+		else if (arg.compare(0, 6, "-mcpu=") == 0)
+		{
+			options.cpu = arg.substr(6);
+		}
+		else if (arg.compare(0, 7, "-mattr=") == 0)
+		{
+			options.features = arg.substr(7);
+		}
+		else if (arg == "--mem-stats")
+		{
+			memStats = true;
+		}
+		else if (arg == "--time-report")
+		{
+			reportOptions.timeReport = true;
+			llvm::TimePassesIsEnabled = true;
+		}
+		else if (arg == "--stats")
+		{
+			reportOptions.stats = true;
+		}
+		else if (arg.compare(0, 13, "--stats-json=") == 0)
+		{
+			reportOptions.jsonFile = arg.substr(13);
+		}
+		else if (arg.compare(0, 8, "--split=") == 0)
+		{
+			options.splitParts = std::max(1, atoi(arg.c_str() + 8));
+		}
+		else if (arg == "--unchecked")
+		{
+			options.boundsChecks = false;
+		}
+		else if (arg == "--ssa")
+		{
+			options.directSSA = true;
+		}
+		else if (arg == "--stream" || arg.compare(0, 9, "--stream=") == 0)
+		{
+			options.streaming = true;
+			options.streamBatch = arg.size() > 9 ? atoi(arg.c_str() + 9) : 0;
+		}
+		else if (arg.compare(0, 12, "--cache-dir=") == 0)
+		{
+			cache.dir = arg.substr(12);
+		}
+		else if (arg.compare(0, 13, "--cache-size=") == 0)
+		{
+			cache.maxBytes = strtoull(arg.c_str() + 13, nullptr, 10) << 20;
+		}
+		else if (arg.compare(0, 14, "--emit-module=") == 0)
+		{
+			moduleFile = arg.substr(14);
+		}
+		else if (arg == "-o" && i + 1 < argc)
+		{
+			outputDir = argv[++i];
+		}
+		else if (arg == "-j" && i + 1 < argc)
+		{
+			threads = std::max(1, atoi(argv[++i]));
+		}
+		else if (arg.size() > 3 && arg.compare(arg.size() - 3, 3, ".wh") == 0)
+		{
+			inputs.push_back(arg);
+		}
+		else
+		{
+			cerr << "Unknown option '" << arg << "'\n";
+			cerr << "Usage: " << argv[0] << " [run] [-O0|-O1|-O2|-O3|-Os|-Oz] [-mcpu=native|<cpu>] [-mattr=<features>] [--ssa] [--unchecked] [--mem-stats] [--time-report] [--stats] [--stats-json=<file>] [--split=<n>] [--stream[=<n>]] [--cache-dir=<dir>] [--cache-size=<MiB>] [--emit-module=<file.whm>] < program.wh\n";
+			cerr << "       " << argv[0] << " [options] [-j <threads>] [-o <dir>] file.wh...\n";
+			return 1;
+		}
+	}
+
+	if (options.streaming && (!moduleFile.empty() || options.splitParts > 1 || (jit && options.streamBatch)))
+	{
+		cerr << "--stream cannot be combined with --emit-module, --split or, with a batch size, run\n";
 		return 1;
 	}
 
-	CodeGenContext context;
-	context.generateCode(*programBlock);
+	if (!inputs.empty())
+	{
+		if (jit)
+		{
+			cerr << "'run' takes the program from stdin\n";
+			return 1;
+		}
+
+		options.verbose = false;
+		return compileAll(inputs, outputDir, threads, options, cache.dir.empty() ? nullptr : &cache, reportOptions);
+	}
+
+	CodeGenContext context(options);
+
+	// mapped when stdin is redirected from a file, read otherwise
+	auto source = SourceBuffer::map("/dev/stdin");
+	if (!source)
+	{
+		cerr << "Could not read the program from stdin\n";
+		return 1;
+	}
 
 	// auto objname = tmpname();
 	auto objname = "output.o";
-	context.buildObject(objname);
+
+	auto key = cacheKey(jit || !moduleFile.empty() || cache.dir.empty() ? nullptr : &cache, source->text(), options, context.stats);
+	if (key && cache.fetch(*key, objname))
+	{
+		if (options.verbose)
+		{
+			cout << "Wrote " << objname << " (cached)\n";
+		}
+
+		context.stats.count("cache_hits", 1);
+		context.stats.count("cache_evictions", cache.evict());
+		report(context.stats, reportOptions);
+		return 0;
+	}
+
+	ParseState parseState;
+	if (!generate(std::move(source), parseState, context, objname))
+	{
+		return 1;
+	}
+
+	if (memStats)
+	{
+		cerr << "AST arena: " << parseState.arena.allocationCount() << " allocations in " << parseState.arena.chunkCount() << " chunks, "
+			 << parseState.arena.bytesAllocated() << " bytes; peak RSS after codegen: " << peakRSS() << " KiB\n";
+	}
+
+	if (!moduleFile.empty())
+	{
+		return writeModule(context, *parseState.programBlock, moduleFile) ? 0 : 1;
+	}
+
+	// the AST is not needed past code generation
+	parseState.arena.release();
+
+	if (jit)
+	{
+		auto result = context.run();
+		report(context.stats, reportOptions);
+		return result;
+	}
+
+	if (key)
+	{
+		// the output may be a hard link into the cache, never write through it
+		llvm::sys::fs::remove(objname);
+	}
+
+	if (!writeObject(context, objname))
+	{
+		return 1;
+	}
+
+	if (key)
+	{
+		cache.store(*key, objname);
+		context.stats.count("cache_misses", 1);
+		context.stats.count("cache_evictions", cache.evict());
+	}
+
+	if (memStats)
+	{
+		cerr << "peak RSS: " << peakRSS() << " KiB\n";
+	}
+
+	report(context.stats, reportOptions);
 	// context.buildExecutable("a.out", objname);
 
 	// remove(objname.c_str());
@@ -0,0 +1,213 @@
+#include "module.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/Metadata.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "cache.hpp"
+#include "codegen.hpp"
+#include "node.hpp"
+#include "parsestate.hpp"
+
+using namespace llvm;
+using namespace Node;
+
+static const char FunctionTable[] = "weirdflex.functions";
+static const char CompilerStamp[] = "weirdflex.compiler";
+
+// The first entry of the table: !{!"weirdflex.compiler", !"compiler id"}
+static bool writtenByThisCompiler(const NamedMDNode &table)
+{
+	if (table.getNumOperands() == 0 || table.getOperand(0)->getNumOperands() != 2)
+	{
+		return false;
+	}
+
+	auto stamp = table.getOperand(0);
+	auto marker = dyn_cast<MDString>(stamp->getOperand(0));
+	auto id = dyn_cast<MDString>(stamp->getOperand(1));
+	return marker && id && marker->getString() == CompilerStamp && id->getString() == compilerId();
+}
+
+// Reads only the metadata of the module, not its functions
+static bool writtenByThisCompiler(const std::string &filename)
+{
+	auto buffer = MemoryBuffer::getFile(filename);
+	if (!buffer)
+	{
+		return false;
+	}
+
+	LLVMContext llvmContext;
+	auto module = getLazyBitcodeModule((*buffer)->getMemBufferRef(), llvmContext);
+	if (!module)
+	{
+		consumeError(module.takeError());
+		return false;
+	}
+	if (auto error = (*module)->materializeMetadata())
+	{
+		consumeError(std::move(error));
+		return false;
+	}
+
+	auto table = (*module)->getNamedMetadata(FunctionTable);
+	return table && writtenByThisCompiler(*table);
+}
+
+std::string moduleFor(const std::string &fname)
+{
+	auto endsWith = [&](const char *suffix) {
+		auto n = strlen(suffix);
+		return fname.size() > n && fname.compare(fname.size() - n, n, suffix) == 0;
+	};
+
+	if (endsWith(".whm"))
+	{
+		return fname;
+	}
+
+	// a stale module, or one from an older compiler, is passed over for the source
+	struct stat source, module;
+	if (endsWith(".wh") && stat(fname.c_str(), &source) == 0 && stat((fname + 'm').c_str(), &module) == 0 && module.st_mtime >= source.st_mtime && writtenByThisCompiler(fname + 'm'))
+	{
+		return fname + 'm';
+	}
+
+	return {};
+}
+
+// Entry: !{!"name", !"return type", i1 variadic, i1 extern, i1 async, !"argument type"...}, type names are empty for void
+bool writeModule(CodeGenContext &context, const Block &root, const std::string &filename)
+{
+	auto &llvmContext = *context.llvmContext;
+	auto table = context.module->getOrInsertNamedMetadata(FunctionTable);
+	table->addOperand(MDTuple::get(llvmContext, {MDString::get(llvmContext, CompilerStamp), MDString::get(llvmContext, compilerId())}));
+
+	for (auto stmt : root.stmts)
+	{
+		auto declaration = dynamic_cast<const FunctionDeclaration *>(stmt);
+		if (!declaration || !declaration->id || declaration->id->name.front() == '_') // private to the module
+		{
+			continue;
+		}
+
+		std::vector<Metadata *> entry{
+			MDString::get(llvmContext, declaration->id->name),
+			MDString::get(llvmContext, declaration->type ? declaration->type->name : ""),
+			ConstantAsMetadata::get(ConstantInt::get(Type::getInt1Ty(llvmContext), declaration->args.variadic)),
+			ConstantAsMetadata::get(ConstantInt::get(Type::getInt1Ty(llvmContext), declaration->external)),
+			ConstantAsMetadata::get(ConstantInt::get(Type::getInt1Ty(llvmContext), declaration->async)),
+		};
+
+		for (auto arg : declaration->args)
+		{
+			entry.push_back(MDString::get(llvmContext, arg->type->name));
+		}
+
+		table->addOperand(MDTuple::get(llvmContext, entry));
+
+		// every object of a program may include the module, the linker keeps one copy
+		auto function = context.module->getFunction(declaration->id->name);
+		if (function && !function->isDeclaration())
+		{
+			function->setLinkage(GlobalValue::LinkOnceODRLinkage);
+		}
+	}
+
+	std::error_code EC;
+	raw_fd_ostream dest(filename, EC, sys::fs::F_None);
+
+	if (EC)
+	{
+		errs() << "Could not open file: " << EC.message();
+		return false;
+	}
+
+	WriteBitcodeToFile(*context.module, dest);
+	dest.flush();
+
+	if (context.options.verbose)
+	{
+		outs() << "Wrote " << filename << " (" << table->getNumOperands() - 1 << " functions, " << dest.tell() << " bytes)\n";
+	}
+
+	return true;
+}
+
+static Identifier *typeIdentifier(ParseState &state, const MDOperand &operand)
+{
+	auto name = cast<MDString>(operand)->getString();
+	return name.empty() ? nullptr : state.retained.make<Identifier>(std::string_view(name.data(), name.size()));
+}
+
+std::vector<Statement *> importModules(CodeGenContext &context, ParseState &state)
+{
+	std::vector<Statement *> declarations;
+
+	for (auto i = state.importedModules; i < state.modules.size(); i++)
+	{
+		auto &filename = state.modules[i];
+		if (std::find(state.modules.begin(), state.modules.begin() + i, filename) != state.modules.begin() + i)
+		{
+			continue; // included twice
+		}
+
+		auto buffer = MemoryBuffer::getFile(filename);
+		if (!buffer)
+		{
+			throw std::runtime_error("cannot read module " + filename + ": " + buffer.getError().message());
+		}
+
+		auto module = parseBitcodeFile((*buffer)->getMemBufferRef(), *context.llvmContext);
+		if (!module)
+		{
+			throw std::runtime_error("invalid module " + filename + ": " + toString(module.takeError()));
+		}
+
+		auto table = (*module)->getNamedMetadata(FunctionTable);
+		if (!table)
+		{
+			throw std::runtime_error(filename + " is not a weirdflex module");
+		}
+		if (!writtenByThisCompiler(*table))
+		{
+			throw std::runtime_error(filename + " was written by another build of the compiler, rebuild it with --emit-module");
+		}
+
+		for (unsigned index = 1; index < table->getNumOperands(); index++) // after the stamp
+		{
+			auto entry = table->getOperand(index);
+			auto name = cast<MDString>(entry->getOperand(0))->getString();
+			auto args = state.retained.make<ArgumentList>();
+			args->variadic = mdconst::extract<ConstantInt>(entry->getOperand(2))->isOne();
+
+			for (unsigned arg = 5; arg < entry->getNumOperands(); arg++)
+			{
+				args->push_back(state.retained.make<VariableDeclaration>(typeIdentifier(state, entry->getOperand(arg)), nullptr, nullptr));
+			}
+
+			declarations.push_back(state.retained.make<FunctionDeclaration>(
+				typeIdentifier(state, entry->getOperand(1)),
+				state.retained.make<Identifier>(std::string_view(name.data(), name.size())),
+				*args,
+				nullptr,
+				mdconst::extract<ConstantInt>(entry->getOperand(3))->isOne(),
+				mdconst::extract<ConstantInt>(entry->getOperand(4))->isOne()));
+		}
+
+		(*module)->eraseNamedMetadata(table);
+		context.imports.push_back(std::move(*module));
+	}
+
+	state.importedModules = state.modules.size();
+	return declarations;
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include <string>
+#include <vector>
+
+struct CodeGenContext;
+struct ParseState;
+
+namespace Node
+{
+struct Block;
+struct Statement;
+} // namespace Node
+
+// Precompiled includes (.whm): the LLVM bitcode of a program made of function
+// declarations, plus a 'weirdflex.functions' metadata table with the name and
+// type names of every public function. An include of a module does not go
+// through the lexer and parser: its table becomes extern declarations and its
+// bitcode is linked into the program after code generation. The table starts with
+// the compiler build that wrote it; a module from any other build is rejected.
+
+// Returns the precompiled module to load for an include: the file itself if it is a .whm, or
+// file.whm next to file.wh if it is at least as new as the source and this compiler wrote it
+std::string moduleFor(const std::string &fname);
+
+// Writes the module generated from root (a program that only declares functions) to filename
+bool writeModule(CodeGenContext &context, const Node::Block &root, const std::string &filename);
+
+// Returns extern declarations (in state.retained) for the functions of the modules included since the last call
+// and queues their bitcode for linking
+std::vector<Node::Statement *> importModules(CodeGenContext &context, ParseState &state);
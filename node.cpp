@@ -9,8 +9,11 @@
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/PassManager.h>
 #include <llvm/IR/Instructions.h>
+#include <llvm/IR/CFG.h>
+#include <llvm/IR/Intrinsics.h>
 #include <llvm/IR/CallingConv.h>
 #include "llvm/IR/IRBuilder.h"
+#include <llvm/IR/MDBuilder.h>
 #include <llvm/Support/raw_ostream.h>
 
 #include "parser.hpp"
@@ -20,133 +23,268 @@ using namespace llvm;
 using namespace std;
 using namespace Node;
 
-llvm::LLVMContext Node::GlobalContext;
-
 IRBuilder<> getBuilder(CodeGenContext &context)
 {
 	return IRBuilder<>(context.currentBlock());
 }
 
-Type *Node::typeOf(const Identifier &type)
+// Stack slots always go to the entry block, where mem2reg and SROA look for them
+AllocaInst *createEntryAlloca(CodeGenContext &context, Type *type, const std::string &name)
+{
+	auto &entry = context.currentBlock()->getParent()->getEntryBlock();
+	return IRBuilder<>(&entry, entry.begin()).CreateAlloca(type, nullptr, name);
+}
+
+// Strings and slices are {T *data, i64 length}
+StructType *sliceType(Type *element)
 {
-	if (type.name == "int")
+	return StructType::get(element->getPointerTo(), Type::getInt64Ty(element->getContext()));
+}
+
+// A string's data stays NUL-terminated so it can be handed to C as is
+StructType *stringType(CodeGenContext &context)
+{
+	return sliceType(Type::getInt8Ty(*context.llvmContext));
+}
+
+Value *createSlice(CodeGenContext &context, StructType *type, Value *data, Value *length)
+{
+	if (isa<Constant>(data) && isa<Constant>(length))
 	{
-		return Type::getInt64Ty(GlobalContext);
+		return ConstantStruct::get(type, {cast<Constant>(data), cast<Constant>(length)});
 	}
-	if (type.name == "double")
+
+	auto builder = getBuilder(context);
+	auto slice = builder.CreateInsertValue(UndefValue::get(type), data, 0);
+	return builder.CreateInsertValue(slice, length, 1);
+}
+
+Value *createString(CodeGenContext &context, Value *data, Value *length)
+{
+	return createSlice(context, stringType(context), data, length);
+}
+
+// int, double or a vector of them
+Type *numericType(CodeGenContext &context, InternalType type)
+{
+	auto scalar = scalarOf(type) == InternalType::Integer ? Type::getInt64Ty(*context.llvmContext) : Type::getDoubleTy(*context.llvmContext);
+	auto lanes = lanesOf(type);
+	return lanes ? VectorType::get(scalar, lanes) : scalar;
+}
+
+Type *Node::typeOf(CodeGenContext &context, const Identifier &type)
+{
+	if (type.symbol == Symbols::Int)
+	{
+		return Type::getInt64Ty(*context.llvmContext);
+	}
+	if (type.symbol == Symbols::Double)
 	{
-		return Type::getDoubleTy(GlobalContext);
+		return Type::getDoubleTy(*context.llvmContext);
 	}
-	if (type.name == "string")
+	if (type.symbol == Symbols::String)
 	{
-		return Type::getInt8PtrTy(GlobalContext);
+		return stringType(context);
 	}
-	if (type.name == "_untyped")
+	if (type.symbol == Symbols::Untyped)
 	{
-		return Type::getInt64PtrTy(GlobalContext);
+		return Type::getInt64PtrTy(*context.llvmContext);
+	}
+	if (type.symbol == Symbols::IntSlice)
+	{
+		return sliceType(Type::getInt64Ty(*context.llvmContext));
+	}
+	if (type.symbol == Symbols::DoubleSlice)
+	{
+		return sliceType(Type::getDoubleTy(*context.llvmContext));
+	}
+	if (lanesOf(typeOf2(type)))
+	{
+		return numericType(context, typeOf2(type)); // wider than the target's registers is fine, legalization splits the operations
 	}
 
-	return Type::getVoidTy(GlobalContext);
+	return Type::getVoidTy(*context.llvmContext);
 }
 
 InternalType Node::typeOf2(const Identifier &type)
 {
-	if (type.name == "int")
+	if (type.symbol == Symbols::Int)
 	{
 		return InternalType::Integer;
 	}
-	if (type.name == "double")
+	if (type.symbol == Symbols::Double)
 	{
 		return InternalType::Float;
 	}
-	if (type.name == "string")
+	if (type.symbol == Symbols::String)
 	{
 		return InternalType::String;
 	}
+	if (type.symbol == Symbols::IntSlice)
+	{
+		return InternalType::IntSlice;
+	}
+	if (type.symbol == Symbols::DoubleSlice)
+	{
+		return InternalType::FloatSlice;
+	}
+	if (type.symbol == Symbols::Int4)
+	{
+		return InternalType::Int4;
+	}
+	if (type.symbol == Symbols::Int8)
+	{
+		return InternalType::Int8;
+	}
+	if (type.symbol == Symbols::Double4)
+	{
+		return InternalType::Float4;
+	}
+	if (type.symbol == Symbols::Double8)
+	{
+		return InternalType::Float8;
+	}
 
 	return InternalType::Invalid;
 }
 
+unsigned Node::lanesOf(InternalType type)
+{
+	switch (type)
+	{
+	case InternalType::Int4:
+	case InternalType::Float4:
+		return 4;
+	case InternalType::Int8:
+	case InternalType::Float8:
+		return 8;
+	default:
+		return 0;
+	}
+}
+
+InternalType Node::scalarOf(InternalType type)
+{
+	switch (type)
+	{
+	case InternalType::Int4:
+	case InternalType::Int8:
+		return InternalType::Integer;
+	case InternalType::Float4:
+	case InternalType::Float8:
+		return InternalType::Float;
+	default:
+		return type;
+	}
+}
+
 Value *Integer::codeGen(CodeGenContext &context) const
 {
-	return ConstantInt::get(GlobalContext, APInt(64, value, false));
+	return ConstantInt::get(*context.llvmContext, APInt(64, value, false));
 }
 
 Value *Float::codeGen(CodeGenContext &context) const
 {
-	return ConstantFP::get(GlobalContext, APFloat(value));
+	return ConstantFP::get(*context.llvmContext, APFloat(value));
 }
 
 Value *String::codeGen(CodeGenContext &context) const
 {
-	return getBuilder(context).CreateGlobalStringPtr(value);
+	auto data = getBuilder(context).CreateGlobalStringPtr(StringRef(value.data(), value.size()));
+	return createString(context, data, ConstantInt::get(Type::getInt64Ty(*context.llvmContext), value.size()));
 }
 
-Value *Identifier::codeGen(CodeGenContext &context) const
+// The current value of the variable decl declares. An argument only counts while no local of
+// its name has replaced it.
+Value *readVariable(CodeGenContext &context, const VariableDeclaration &decl)
 {
-	if (auto arg = context.args().find(name))
+	auto symbol = decl.id->symbol;
+	if (auto arg = context.args().find(symbol); arg && arg->node == &decl)
 	{
 		return arg->value;
 	}
 
-	if (auto local = context.locals().find(name))
+	if (auto local = context.locals().find(symbol))
 	{
+		if (!local->value)
+		{
+			return context.ssa().readVariable(symbol, context.currentBlock());
+		}
+
 		return getBuilder(context).CreateLoad(local->value);
 	}
 
-	throw runtime_error("(Identifier) undeclared variable " + name + '\n');
+	throw runtime_error("(Identifier) undeclared variable " + decl.id->name + '\n');
+}
+
+Value *Identifier::codeGen(CodeGenContext &context) const
+{
+	return readVariable(context, *decl); // bound by Sema
 }
 
 Value *Block::codeGen(CodeGenContext &context) const
 {
-	int r = rand();
 	Value *last = nullptr;
 	for (auto s : stmts)
 	{
+		if (context.currentBlock()->getTerminator()) // after return, break or continue
+		{
+			break;
+		}
+
 		last = s->codeGen(context);
 	}
 
 	return last;
 }
 
-Value *Assignment::codeGen(CodeGenContext &context) const
+// Stores to a local's stack slot, or makes value its current one with --ssa
+Value *writeLocal(CodeGenContext &context, const Identifier &id, Value *value)
 {
-	auto l = context.locals().find(lhs.name);
+	auto l = context.locals().find(id.symbol);
 	if (!l)
 	{
-		throw runtime_error("(Assignment) undeclared variable: " + lhs.name);
+		throw runtime_error("(Assignment) undeclared variable: " + id.name);
 	}
 
-	return getBuilder(context).CreateStore(rhs.codeGen(context), l->value);
+	if (!l->value)
+	{
+		context.ssa().writeVariable(id.symbol, context.currentBlock(), value);
+		return value;
+	}
+
+	return getBuilder(context).CreateStore(value, l->value);
+}
+
+Value *Assignment::codeGen(CodeGenContext &context) const
+{
+	return writeLocal(context, lhs, rhs.codeGen(context));
 }
 
 Value *createArithmeticOp(CodeGenContext &context, Value *left, Value *right, int op)
 {
+	bool fp = left->getType()->isFPOrFPVectorTy();
+
 	Instruction::BinaryOps instr;
 	switch (op)
 	{
 	case PLUS:
-		instr = Instruction::Add;
+		instr = fp ? Instruction::FAdd : Instruction::Add;
 		break;
 	case MINUS:
-		instr = Instruction::Sub;
+		instr = fp ? Instruction::FSub : Instruction::Sub;
 		break;
 	case MUL:
-		instr = Instruction::Mul;
+		instr = fp ? Instruction::FMul : Instruction::Mul;
 		break;
 	case DIV:
-		instr = Instruction::SDiv;
+		instr = fp ? Instruction::FDiv : Instruction::SDiv;
 		break;
 	default:
-		break;
-	}
-
-	if (instr != 0)
-	{
-		return getBuilder(context).CreateBinOp(instr, left, right);
+		return nullptr;
 	}
 
-	return nullptr;
+	return getBuilder(context).CreateBinOp(instr, left, right);
 }
 
 Value *createIntBinaryOp(CodeGenContext &context, Value *left, Value *right, int op)
@@ -162,22 +300,29 @@ Value *createIntBinaryOp(CodeGenContext &context, Value *left, Value *right, int
 	{
 	case EQ:
 		pred = CmpInst::ICMP_EQ;
+		break;
 	case NE:
 		pred = CmpInst::ICMP_NE;
+		break;
 	case LT:
 		pred = CmpInst::ICMP_SLT;
+		break;
 	case GT:
 		pred = CmpInst::ICMP_SGT;
+		break;
 	case LE:
 		pred = CmpInst::ICMP_SLE;
+		break;
 	case GE:
 		pred = CmpInst::ICMP_SGE;
+		break;
 
 	default:
 		throw runtime_error("unsupported operator " + to_string(op));
 	}
 
-	return getBuilder(context).CreateICmp(pred, left, right);
+	auto builder = getBuilder(context);
+	return builder.CreateZExt(builder.CreateICmp(pred, left, right), left->getType()); // comparisons are int
 }
 
 Value *createDoubleBinaryOp(CodeGenContext &context, Value *left, Value *right, int op)
@@ -193,83 +338,430 @@ Value *createDoubleBinaryOp(CodeGenContext &context, Value *left, Value *right,
 	{
 	case EQ:
 		pred = CmpInst::FCMP_OEQ;
+		break;
 	case NE:
-		pred = CmpInst::FCMP_ONE;
+		pred = CmpInst::FCMP_UNE; // true for NaN, like C
+		break;
 	case LT:
 		pred = CmpInst::FCMP_OLT;
+		break;
 	case GT:
 		pred = CmpInst::FCMP_OGT;
+		break;
 	case LE:
 		pred = CmpInst::FCMP_OLE;
+		break;
 	case GE:
 		pred = CmpInst::FCMP_OGE;
+		break;
 
 	default:
 		throw runtime_error("unsupported operator " + to_string(op));
 	}
 
-	return getBuilder(context).CreateFCmp(pred, left, right);
+	auto builder = getBuilder(context);
+	Type *type = builder.getInt64Ty();
+	if (auto vector = dyn_cast<VectorType>(left->getType()))
+	{
+		type = VectorType::getInteger(vector); // <n x i64>
+	}
+
+	return builder.CreateZExt(builder.CreateFCmp(pred, left, right), type);
 }
 
-Value *createStringAddition(CodeGenContext &context, Value *left, Value *right)
+// Flattens a chain of string '+' such as a + "b" + (c + d) into its operands, in order
+void collectConcatOperands(const Expression *expr, vector<const Expression *> &operands)
 {
-	Function *function = context.module->getFunction("concat");
-	return getBuilder(context).CreateCall(function, {left, right});
+	auto binary = dynamic_cast<const Node::BinaryOperator *>(expr);
+	if (binary && binary->op == PLUS && binary->resolvedType == InternalType::String)
+	{
+		collectConcatOperands(binary->lhs, operands);
+		collectConcatOperands(binary->rhs, operands);
+		return;
+	}
+
+	operands.push_back(expr);
+}
+
+// Lowers a whole chain of string '+' at once: adjacent literals are joined at compile time, then
+// the total length is summed from the operands' own lengths, the result is allocated once and every
+// operand is copied into place
+Value *createStringConcatenation(CodeGenContext &context, const Node::BinaryOperator &chain)
+{
+	vector<const Expression *> operands;
+	collectConcatOperands(&chain, operands);
+
+	struct Piece
+	{
+		Value *pointer;
+		Value *length;
+	};
+
+	auto sizeType = Type::getInt64Ty(*context.llvmContext);
+	vector<Piece> pieces;
+
+	for (size_t i = 0; i < operands.size();)
+	{
+		auto literal = dynamic_cast<const String *>(operands[i]);
+		if (!literal)
+		{
+			auto string = operands[i++]->codeGen(context);
+			auto builder = getBuilder(context); // operands can end in a new block (bounds checks)
+			pieces.push_back(Piece{pointer : builder.CreateExtractValue(string, 0), length : builder.CreateExtractValue(string, 1)});
+			continue;
+		}
+
+		std::string folded;
+		for (; i < operands.size() && (literal = dynamic_cast<const String *>(operands[i])); i++)
+		{
+			folded.append(literal->value.data(), literal->value.size());
+		}
+
+		pieces.push_back(Piece{pointer : getBuilder(context).CreateGlobalStringPtr(folded), length : ConstantInt::get(sizeType, folded.size())});
+	}
+
+	if (pieces.size() == 1 && isa<Constant>(pieces.front().length)) // nothing but literals
+	{
+		return createString(context, pieces.front().pointer, pieces.front().length);
+	}
+
+	auto builder = getBuilder(context);
+	Value *length = ConstantInt::get(sizeType, 0);
+	for (auto &piece : pieces)
+	{
+		length = builder.CreateAdd(length, piece.length);
+	}
+
+	auto total = builder.CreateAdd(length, ConstantInt::get(sizeType, 1)); // the terminating NUL
+	auto alloc = context.module->getOrInsertFunction("wf_alloc", builder.getInt8PtrTy(), sizeType);
+	auto result = builder.CreateCall(alloc, {total}, "concat");
+
+	Value *offset = ConstantInt::get(sizeType, 0);
+	for (auto &piece : pieces)
+	{
+		builder.CreateMemCpy(builder.CreateInBoundsGEP(builder.getInt8Ty(), result, offset), 1, piece.pointer, 1, piece.length);
+		offset = builder.CreateAdd(offset, piece.length);
+	}
+
+	builder.CreateStore(builder.getInt8(0), builder.CreateInBoundsGEP(builder.getInt8Ty(), result, offset));
+	return createString(context, result, length);
+}
+
+// Continues in a new block if inBounds holds, calls wf_bounds_fail(index, length) otherwise. The
+// failing side is cold and noreturn, which lets LICM and IRCE move or drop the check in loops.
+// Nothing is emitted with --unchecked.
+void createBoundsCheck(CodeGenContext &context, Value *inBounds, Value *index, Value *length)
+{
+	if (!context.options.boundsChecks)
+	{
+		return;
+	}
+
+	auto &llvmContext = *context.llvmContext;
+	auto function = context.currentBlock()->getParent();
+	auto ok = BasicBlock::Create(llvmContext, "bounds.ok", function);
+	auto fail = BasicBlock::Create(llvmContext, "bounds.fail", function);
+
+	auto builder = getBuilder(context);
+	builder.CreateCondBr(inBounds, ok, fail, MDBuilder(llvmContext).createBranchWeights(1 << 20, 1));
+
+	auto sizeType = builder.getInt64Ty();
+	auto callee = context.module->getOrInsertFunction("wf_bounds_fail", builder.getVoidTy(), sizeType, sizeType);
+	if (auto declaration = dyn_cast<Function>(callee.getCallee()))
+	{
+		declaration->setDoesNotReturn();
+		declaration->setDoesNotThrow();
+		declaration->addFnAttr(Attribute::Cold);
+	}
+
+	IRBuilder<> failBuilder(fail);
+	failBuilder.CreateCall(callee, {index, length})->setDoesNotReturn();
+	failBuilder.CreateUnreachable();
+
+	context.ssa().sealBlock(ok);
+	context.ssa().sealBlock(fail);
+	context.setInsertBlock(ok);
+}
+
+// index < length, unsigned so that negative indices fail too
+void createBoundsCheck(CodeGenContext &context, Value *index, Value *length, CmpInst::Predicate predicate = CmpInst::ICMP_ULT)
+{
+	if (context.options.boundsChecks)
+	{
+		createBoundsCheck(context, getBuilder(context).CreateICmp(predicate, index, length, "inbounds"), index, length);
+	}
+}
+
+// &slice[index] after checking index; a plain inbounds GEP, so traversals vectorize
+Value *createElementPointer(CodeGenContext &context, Value *slice, Value *index)
+{
+	auto data = getBuilder(context).CreateExtractValue(slice, 0, "data");
+	auto length = getBuilder(context).CreateExtractValue(slice, 1, "len");
+	createBoundsCheck(context, index, length);
+
+	auto elementType = data->getType()->getPointerElementType();
+	return getBuilder(context).CreateInBoundsGEP(elementType, data, index);
+}
+
+Value *SliceAllocation::codeGen(CodeGenContext &context) const
+{
+	auto count = length.codeGen(context);
+	auto type = cast<StructType>(typeOf(context, this->type));
+	auto elementType = type->getElementType(0)->getPointerElementType();
+
+	// 0 <= count <= INT64_MAX / sizeof(T), so the size neither wraps nor goes negative
+	auto sizeType = Type::getInt64Ty(*context.llvmContext);
+	auto elementSize = context.module->getDataLayout().getTypeAllocSize(elementType);
+	createBoundsCheck(context, count, ConstantInt::get(sizeType, INT64_MAX / elementSize), CmpInst::ICMP_ULE);
+
+	auto builder = getBuilder(context);
+	auto size = builder.CreateMul(count, ConstantInt::get(sizeType, elementSize), "size");
+	auto alloc = context.module->getOrInsertFunction("wf_alloc", builder.getInt8PtrTy(), sizeType);
+	auto memory = builder.CreateCall(alloc, {size});
+	builder.CreateMemSet(memory, builder.getInt8(0), size, 16);
+
+	return createSlice(context, type, builder.CreateBitCast(memory, type->getElementType(0)), count);
+}
+
+Value *ArrayIndex::codeGen(CodeGenContext &context) const
+{
+	auto slice = array.codeGen(context);
+	auto position = index.codeGen(context);
+
+	if (auto lanes = lanesOf(array.resolvedType)) // a vector lane
+	{
+		if (!isa<ConstantInt>(position) || cast<ConstantInt>(position)->getZExtValue() >= lanes)
+		{
+			createBoundsCheck(context, position, ConstantInt::get(position->getType(), lanes));
+		}
+
+		return getBuilder(context).CreateExtractElement(slice, position);
+	}
+
+	auto element = createElementPointer(context, slice, position);
+	return getBuilder(context).CreateLoad(element);
+}
+
+Value *ArrayAssignment::codeGen(CodeGenContext &context) const
+{
+	auto slice = array.codeGen(context);
+	auto position = index.codeGen(context);
+	auto value = rhs.codeGen(context);
+
+	auto element = createElementPointer(context, slice, position);
+	getBuilder(context).CreateStore(value, element);
+	return value;
+}
+
+Value *SubSlice::codeGen(CodeGenContext &context) const
+{
+	auto slice = array.codeGen(context);
+	auto from = low.codeGen(context);
+	auto to = high.codeGen(context);
+
+	auto length = getBuilder(context).CreateExtractValue(slice, 1, "len");
+	createBoundsCheck(context, to, length, CmpInst::ICMP_ULE);
+	createBoundsCheck(context, from, to, CmpInst::ICMP_ULE);
+
+	auto builder = getBuilder(context);
+	auto data = builder.CreateExtractValue(slice, 0, "data");
+	auto start = builder.CreateInBoundsGEP(data->getType()->getPointerElementType(), data, from);
+	return createSlice(context, cast<StructType>(slice->getType()), start, builder.CreateSub(to, from));
+}
+
+Value *Length::codeGen(CodeGenContext &context) const
+{
+	auto value = operand.codeGen(context);
+	return getBuilder(context).CreateExtractValue(value, 1, "len");
 }
 
 Value *Node::BinaryOperator::codeGen(CodeGenContext &context) const
 {
-	CmpInst::Predicate pred;
+	if (resolvedType == InternalType::String && op == PLUS)
+	{
+		return createStringConcatenation(context, *this);
+	}
 
-	auto leftT = lhs->GetType(context);
-	auto rightT = rhs->GetType(context);
 	auto left = lhs->codeGen(context);
 	auto right = rhs->codeGen(context);
 
-	if (leftT != rightT)
+	// element-wise on vectors
+	if (left->getType()->isIntOrIntVectorTy() && right->getType() == left->getType())
 	{
-		throw runtime_error("cannot create binary operator for different argument types");
+		return createIntBinaryOp(context, left, right, op);
 	}
 
-	if (left->getType()->isIntegerTy() && right->getType()->isIntegerTy())
+	if (left->getType()->isFPOrFPVectorTy() && right->getType() == left->getType())
 	{
-		return createIntBinaryOp(context, left, right, op);
+		return createDoubleBinaryOp(context, left, right, op);
 	}
 
-	if (left->getType()->isFloatingPointTy() && right->getType()->isFloatingPointTy())
+	throw runtime_error("operator not implemented for these arguments");
+}
+
+// The promise of a task: whom to resume when it is done, whether nobody awaits it, and its result
+StructType *promiseType(CodeGenContext &context, const Identifier *type)
+{
+	auto &llvmContext = *context.llvmContext;
+	vector<Type *> fields{Type::getInt8PtrTy(llvmContext), Type::getInt1Ty(llvmContext)};
+	if (type)
 	{
-		return createDoubleBinaryOp(context, left, right, op);
+		fields.push_back(typeOf(context, *type));
 	}
 
-	if (lhs->GetType(context) == InternalType::String && op == PLUS)
+	return StructType::get(llvmContext, fields);
+}
+
+// The promise of the task a handle stands for, at the same place in every frame
+Value *createPromise(CodeGenContext &context, Value *task, StructType *type)
+{
+	auto builder = getBuilder(context);
+	auto promise = builder.CreateCall(Intrinsic::getDeclaration(context.module.get(), Intrinsic::coro_promise), {task, builder.getInt32(8), builder.getFalse()});
+	return builder.CreateBitCast(promise, type->getPointerTo(), "promise");
+}
+
+// Suspends the current task; resume is where it goes on when resumed, null for the final suspend, and
+// cleanup where it goes when destroyed instead, null for the frame to be freed right away
+void createSuspend(CodeGenContext &context, BasicBlock *resume, BasicBlock *cleanup = nullptr)
+{
+	auto &coroutine = *context.blocks.top().coroutine;
+	auto builder = getBuilder(context);
+	auto suspend = Intrinsic::getDeclaration(context.module.get(), Intrinsic::coro_suspend);
+	auto state = builder.CreateCall(suspend, {ConstantTokenNone::get(*context.llvmContext), builder.getInt1(!resume)});
+
+	if (!resume) // a task done is destroyed, never resumed
 	{
-		return createStringAddition(context, left, right);
+		resume = BasicBlock::Create(*context.llvmContext, "coro.done", context.currentBlock()->getParent());
+		IRBuilder<>(resume).CreateUnreachable();
 	}
 
-	throw runtime_error("operator not implemented for these arguments");
+	auto branch = builder.CreateSwitch(state, coroutine.suspend, 2);
+	branch->addCase(builder.getInt8(0), resume);
+	branch->addCase(builder.getInt8(1), cleanup ? cleanup : coroutine.cleanup);
+}
+
+// An async function becomes a coroutine, which LLVM's coroutine passes split into the function
+// a call goes to and the functions resuming and destroying its task. The call allocates the frame
+// and returns the task suspended before the body, for await to run at once or spawn to queue.
+void createCoroutineBegin(CodeGenContext &context, const FunctionDeclaration &declaration)
+{
+	auto &llvmContext = *context.llvmContext;
+	auto module = context.module.get();
+	auto function = context.currentBlock()->getParent();
+	auto entry = context.currentBlock();
+	auto int8Ptr = Type::getInt8PtrTy(llvmContext);
+	auto null = ConstantPointerNull::get(int8Ptr);
+	function->addFnAttr("coroutine.presplit", "0"); // not split yet, as clang marks its coroutines
+
+	auto type = promiseType(context, declaration.type);
+	auto promise = createEntryAlloca(context, type, "promise");
+	auto builder = getBuilder(context);
+	auto id = builder.CreateCall(Intrinsic::getDeclaration(module, Intrinsic::coro_id), {builder.getInt32(0), builder.CreateBitCast(promise, int8Ptr), null, null}, "id");
+
+	// no frame to allocate when the optimizer has put it in the frame of the task awaiting this one
+	auto allocate = BasicBlock::Create(llvmContext, "coro.alloc", function);
+	auto begin = BasicBlock::Create(llvmContext, "coro.begin", function);
+	builder.CreateCondBr(builder.CreateCall(Intrinsic::getDeclaration(module, Intrinsic::coro_alloc), {id}), allocate, begin);
+
+	builder.SetInsertPoint(allocate);
+	auto size = builder.CreateCall(Intrinsic::getDeclaration(module, Intrinsic::coro_size, {builder.getInt64Ty()}));
+	auto memory = builder.CreateCall(module->getOrInsertFunction("wf_task_frame", int8Ptr, builder.getInt64Ty()), {size});
+	builder.CreateBr(begin);
+
+	builder.SetInsertPoint(begin);
+	auto frame = builder.CreatePHI(int8Ptr, 2);
+	frame->addIncoming(null, entry);
+	frame->addIncoming(memory, allocate);
+	auto handle = builder.CreateCall(Intrinsic::getDeclaration(module, Intrinsic::coro_begin), {id, frame}, "task");
+	builder.CreateStore(null, builder.CreateStructGEP(type, promise, 0));
+	builder.CreateStore(builder.getFalse(), builder.CreateStructGEP(type, promise, 1));
+
+	context.ssa().sealBlock(allocate);
+	context.ssa().sealBlock(begin);
+	context.setInsertBlock(begin);
+
+	auto final = BasicBlock::Create(llvmContext, "coro.final");
+	auto cleanup = BasicBlock::Create(llvmContext, "coro.cleanup");
+	auto suspend = BasicBlock::Create(llvmContext, "coro.suspend");
+	context.blocks.top().coroutine = Coroutine{id : id, handle : handle, promise : promise, final : final, cleanup : cleanup, suspend : suspend};
+
+	auto body = BasicBlock::Create(llvmContext, "coro.body", function);
+	createSuspend(context, body);
+	context.ssa().sealBlock(body);
+	context.setInsertBlock(body);
+}
+
+// Every return ends up in final: the task awaiting this one is made ready, unless it was spawned and
+// nobody awaits it, then it frees its own frame
+void createCoroutineEnd(CodeGenContext &context)
+{
+	auto &llvmContext = *context.llvmContext;
+	auto module = context.module.get();
+	auto function = context.currentBlock()->getParent();
+	auto &coroutine = *context.blocks.top().coroutine;
+	auto type = cast<StructType>(coroutine.promise->getAllocatedType());
+
+	coroutine.final->insertInto(function);
+	context.ssa().sealBlock(coroutine.final);
+	context.setInsertBlock(coroutine.final);
+	auto notify = BasicBlock::Create(llvmContext, "coro.notify", function);
+	auto builder = getBuilder(context);
+	builder.CreateCondBr(builder.CreateLoad(builder.CreateStructGEP(type, coroutine.promise, 1), "detached"), coroutine.cleanup, notify);
+
+	context.ssa().sealBlock(notify);
+	context.setInsertBlock(notify);
+	builder.SetInsertPoint(notify);
+	auto continuation = builder.CreateLoad(builder.CreateStructGEP(type, coroutine.promise, 0), "continuation");
+	builder.CreateCall(module->getOrInsertFunction("wf_task_ready", builder.getVoidTy(), builder.getInt8PtrTy()), {continuation});
+	createSuspend(context, nullptr);
+
+	coroutine.cleanup->insertInto(function);
+	context.ssa().sealBlock(coroutine.cleanup);
+	builder.SetInsertPoint(coroutine.cleanup);
+	auto memory = builder.CreateCall(Intrinsic::getDeclaration(module, Intrinsic::coro_free), {coroutine.id, coroutine.handle});
+	builder.CreateCall(module->getOrInsertFunction("wf_task_free", builder.getVoidTy(), builder.getInt8PtrTy()), {memory}); // null if not allocated
+	builder.CreateBr(coroutine.suspend);
+
+	coroutine.suspend->insertInto(function);
+	context.ssa().sealBlock(coroutine.suspend);
+	context.setInsertBlock(coroutine.suspend);
+	builder.SetInsertPoint(coroutine.suspend);
+	builder.CreateCall(Intrinsic::getDeclaration(module, Intrinsic::coro_end), {coroutine.handle, builder.getFalse()});
+	builder.CreateRet(coroutine.handle);
 }
 
 Value *FunctionDeclaration::codeGen(CodeGenContext &context) const
 {
+	// C functions see strings as plain char *, MethodCall converts at the call site
+	auto abiType = [&](Type *type) -> Type * {
+		return external && type == stringType(context) ? Type::getInt8PtrTy(*context.llvmContext) : type;
+	};
+
 	vector<Type *> argTypes;
 	for (auto arg : args)
 	{
-		argTypes.push_back(typeOf(*arg->type));
+		argTypes.push_back(abiType(typeOf(context, *arg->type)));
+	}
+
+	auto returnType = type ? abiType(typeOf(context, *type)) : Type::getVoidTy(*context.llvmContext);
+	if (async)
+	{
+		returnType = Type::getInt8PtrTy(*context.llvmContext); // the task
 	}
 
-	auto returnType = type ? typeOf(*type) : Type::getVoidTy(GlobalContext);
 	FunctionType *ftype = FunctionType::get(returnType, argTypes, args.variadic);
 	auto linkage = (id->name.empty() || id->name.front() == '_') ? GlobalValue::InternalLinkage : GlobalValue::ExternalLinkage;
 	Function *function = Function::Create(ftype, linkage, id->name, context.module.get());
 
-	context.functions[id->name] = NodeInfo{node : dynamic_cast<const Expression *>(this), value : function};
+	context.functions[id->symbol] = NodeInfo{node : dynamic_cast<const Expression *>(this), value : function};
 	if (!block) // declaration
 	{
 		return function;
 	}
 
-	BasicBlock *bblock = BasicBlock::Create(GlobalContext, "", function);
+	BasicBlock *bblock = BasicBlock::Create(*context.llvmContext, "entry", function);
 	context.pushBlock(bblock);
+	context.ssa().sealBlock(bblock); // the entry block has no predecessors
 
 	auto argsValues = function->arg_begin();
 	for (auto it = args.begin(); it != args.end(); it++)
@@ -277,57 +769,378 @@ Value *FunctionDeclaration::codeGen(CodeGenContext &context) const
 		auto arg = *it;
 		auto argumentValue = argsValues++;
 		argumentValue->setName(arg->id->name);
-		context.args()[arg->id->name] = NodeInfo{node : arg, value : argumentValue};
+		context.args()[arg->id->symbol] = NodeInfo{node : arg, value : argumentValue};
+	}
+
+	if (async)
+	{
+		createCoroutineBegin(context, *this);
 	}
 
 	block->codeGen(context);
 
-	if (bblock->getTerminator() == nullptr) // implicit 'void' return
+	if (context.currentBlock()->getTerminator() == nullptr) // implicit 'void' return
 	{
-		return getBuilder(context).CreateRetVoid();
+		if (async && !type)
+		{
+			getBuilder(context).CreateBr(context.blocks.top().coroutine->final);
+		}
+		else if (returnType->isVoidTy())
+		{
+			getBuilder(context).CreateRetVoid();
+		}
+		else if (context.currentBlock() == &function->getEntryBlock() || !pred_empty(context.currentBlock()))
+		{
+			throw runtime_error("missing return at the end of function " + id->name);
+		}
+		else
+		{
+			getBuilder(context).CreateUnreachable(); // nothing gets here, e.g. after an endless loop
+		}
+	}
+
+	if (async)
+	{
+		createCoroutineEnd(context);
 	}
 
 	context.popBlock();
 	return function;
 }
 
+// Masks are int vectors, a lane is on if it is not 0
+Value *createMask(CodeGenContext &context, Value *mask)
+{
+	return getBuilder(context).CreateICmpNE(mask, Constant::getNullValue(mask->getType()), "mask");
+}
+
+// The address of lanes elements from slice[index] on, as a vector pointer. Each lane that is
+// loaded or stored (on in the mask, if there is one) is checked to be within the slice.
+Value *createVectorPointer(CodeGenContext &context, Value *slice, Value *index, unsigned lanes, Value *mask)
+{
+	auto builder = getBuilder(context);
+	auto data = builder.CreateExtractValue(slice, 0, "data");
+	auto length = builder.CreateExtractValue(slice, 1, "len");
+
+	if (!mask)
+	{
+		createBoundsCheck(context, index, length, CmpInst::ICMP_ULE);
+		createBoundsCheck(context, ConstantInt::get(length->getType(), lanes), getBuilder(context).CreateSub(length, index), CmpInst::ICMP_ULE);
+	}
+	else if (context.options.boundsChecks)
+	{
+		// index + lane < length or the lane is off, for every lane
+		vector<Constant *> offsets;
+		for (unsigned lane = 0; lane < lanes; lane++)
+		{
+			offsets.push_back(ConstantInt::get(length->getType(), lane));
+		}
+
+		auto positions = builder.CreateAdd(builder.CreateVectorSplat(lanes, index), ConstantVector::get(offsets));
+		auto inside = builder.CreateICmpULT(positions, builder.CreateVectorSplat(lanes, length));
+		auto allowed = builder.CreateAndReduce(builder.CreateOr(inside, builder.CreateNot(mask)));
+		createBoundsCheck(context, allowed, index, length);
+	}
+
+	auto elementType = data->getType()->getPointerElementType();
+	auto element = getBuilder(context).CreateInBoundsGEP(elementType, data, index);
+	return getBuilder(context).CreateBitCast(element, VectorType::get(elementType, lanes)->getPointerTo());
+}
+
+Value *createBuiltin(CodeGenContext &context, const MethodCall &call)
+{
+	vector<Value *> args;
+	for (auto arg : call.args)
+	{
+		args.push_back(arg->codeGen(context));
+	}
+
+	auto builder = getBuilder(context);
+	auto lanes = lanesOf(call.resolvedType);
+
+	switch (call.builtin)
+	{
+	case Builtin::Vector:
+		if (args.size() == 1)
+		{
+			return builder.CreateVectorSplat(lanes, args[0]);
+		}
+		else
+		{
+			Value *vector = UndefValue::get(typeOf(context, call.id));
+			for (unsigned lane = 0; lane < lanes; lane++)
+			{
+				vector = builder.CreateInsertElement(vector, args[lane], lane);
+			}
+
+			return vector;
+		}
+
+	case Builtin::Shuffle:
+	{
+		auto twoSources = args.size() > 1 && args[1]->getType() == args[0]->getType();
+		auto first = twoSources ? 2 : 1;
+
+		vector<uint32_t> mask;
+		for (size_t i = first; i < call.args.size(); i++)
+		{
+			mask.push_back(static_cast<const Integer *>(call.args[i])->value);
+		}
+
+		auto second = twoSources ? args[1] : UndefValue::get(args[0]->getType());
+		return builder.CreateShuffleVector(args[0], second, ConstantDataVector::get(*context.llvmContext, mask));
+	}
+
+	case Builtin::ReduceAdd:
+	case Builtin::ReduceMul:
+		if (args[0]->getType()->isFPOrFPVectorTy())
+		{
+			// in any lane order, which is what makes it a tree of vector adds
+			auto add = call.builtin == Builtin::ReduceAdd;
+			auto start = ConstantFP::get(builder.getDoubleTy(), add ? -0.0 : 1.0);
+			auto reduction = add ? builder.CreateFAddReduce(start, args[0]) : builder.CreateFMulReduce(start, args[0]);
+			FastMathFlags flags;
+			flags.setAllowReassoc();
+			reduction->setFastMathFlags(flags);
+			return reduction;
+		}
+
+		return call.builtin == Builtin::ReduceAdd ? builder.CreateAddReduce(args[0]) : builder.CreateMulReduce(args[0]);
+
+	case Builtin::ReduceMin:
+		return args[0]->getType()->isFPOrFPVectorTy() ? builder.CreateFPMinReduce(args[0], false) : builder.CreateIntMinReduce(args[0], true);
+
+	case Builtin::ReduceMax:
+		return args[0]->getType()->isFPOrFPVectorTy() ? builder.CreateFPMaxReduce(args[0], false) : builder.CreateIntMaxReduce(args[0], true);
+
+	case Builtin::Load:
+	{
+		auto mask = args.size() > 2 ? createMask(context, args[2]) : nullptr;
+		auto pointer = createVectorPointer(context, args[0], args[1], lanes, mask);
+		if (mask)
+		{
+			auto zero = Constant::getNullValue(pointer->getType()->getPointerElementType());
+			return getBuilder(context).CreateMaskedLoad(pointer, 8, mask, zero);
+		}
+
+		return getBuilder(context).CreateAlignedLoad(pointer, 8);
+	}
+
+	case Builtin::Store:
+	{
+		auto mask = args.size() > 3 ? createMask(context, args[3]) : nullptr;
+		auto pointer = createVectorPointer(context, args[0], args[1], lanesOf(call.args[2]->resolvedType), mask);
+		if (mask)
+		{
+			getBuilder(context).CreateMaskedStore(args[2], pointer, 8, mask);
+		}
+		else
+		{
+			getBuilder(context).CreateAlignedStore(args[2], pointer, 8);
+		}
+
+		return args[2];
+	}
+
+	default:
+		throw runtime_error("function '" + call.id.name + "' not found");
+	}
+}
+
 Value *MethodCall::codeGen(CodeGenContext &context) const
 {
-	Function *function = context.module->getFunction(id.name);
-	if (function == nullptr)
+	if (builtin != Builtin::None)
+	{
+		return createBuiltin(context, *this);
+	}
+
+	// decl is bound by Sema, the table only maps it to the function emitted for it
+	auto declaration = context.functions.find(decl->id->symbol);
+	if (!declaration)
 	{
 		throw runtime_error("function '" + id.name + "' not found");
 	}
 
+	auto function = cast<Function>(declaration->value);
+	auto external = decl->external;
+
 	vector<Value *> argv;
 	for (auto arg : args)
 	{
-		argv.push_back(arg->codeGen(context));
+		auto value = arg->codeGen(context);
+		if (external && value->getType() == stringType(context)) // variadic arguments included
+		{
+			value = getBuilder(context).CreateExtractValue(value, 0);
+		}
+
+		argv.push_back(value);
+	}
+
+	auto builder = getBuilder(context);
+	Value *result = builder.CreateCall(function, argv);
+	if (external && decl->type && decl->type->symbol == Symbols::String)
+	{
+		auto sizeType = builder.getInt64Ty();
+		auto strlen = context.module->getOrInsertFunction("strlen", sizeType, builder.getInt8PtrTy());
+		result = createString(context, result, builder.CreateCall(strlen, {result}));
+	}
+
+	return result;
+}
+
+// await read/write/sleep: the runtime stores the result in the task's frame, at once or from wf_run
+Value *createAwaitIO(CodeGenContext &context, const MethodCall &call)
+{
+	vector<Value *> args;
+	for (auto arg : call.args)
+	{
+		args.push_back(arg->codeGen(context));
+	}
+
+	auto &llvmContext = *context.llvmContext;
+	auto &module = *context.module;
+	auto &coroutine = *context.blocks.top().coroutine;
+	auto int64 = Type::getInt64Ty(llvmContext);
+	auto int8Ptr = Type::getInt8PtrTy(llvmContext);
+	auto builder = getBuilder(context);
+
+	AllocaInst *result;
+	Value *done;
+	switch (call.builtin)
+	{
+	case Builtin::Read:
+		result = createEntryAlloca(context, stringType(context), "read");
+		done = builder.CreateCall(module.getOrInsertFunction("wf_read", int64, int8Ptr, int64, int64, stringType(context)->getPointerTo()), {coroutine.handle, args[0], args[1], result});
+		break;
+
+	case Builtin::Write:
+		result = createEntryAlloca(context, int64, "written");
+		done = builder.CreateCall(module.getOrInsertFunction("wf_write", int64, int8Ptr, int64, int8Ptr, int64, int64->getPointerTo()),
+								  {coroutine.handle, args[0], builder.CreateExtractValue(args[1], 0), builder.CreateExtractValue(args[1], 1), result});
+		break;
+
+	default:
+		result = createEntryAlloca(context, int64, "slept");
+		done = builder.CreateCall(module.getOrInsertFunction("wf_sleep", int64, int8Ptr, int64, int64->getPointerTo()), {coroutine.handle, args[0], result});
 	}
 
-	return getBuilder(context).CreateCall(function, argv);
+	auto function = context.currentBlock()->getParent();
+	auto wait = BasicBlock::Create(llvmContext, "await.wait", function);
+	auto ready = BasicBlock::Create(llvmContext, "await.ready");
+	builder.CreateCondBr(builder.CreateICmpNE(done, ConstantInt::get(int64, 0)), ready, wait);
+
+	context.ssa().sealBlock(wait);
+	context.setInsertBlock(wait);
+	createSuspend(context, ready);
+
+	ready->insertInto(function);
+	context.ssa().sealBlock(ready);
+	context.setInsertBlock(ready);
+	return getBuilder(context).CreateLoad(result);
 }
 
-Value *VariableDeclaration::codeGen(CodeGenContext &context) const
+// The task of the callee runs right away, on until it is done or first suspends; in that case this
+// task suspends as its continuation. The callee's frame is destroyed once its result is read, so
+// when its call is inlined the optimizer can put the frame in this task's instead of allocating it.
+Value *Await::codeGen(CodeGenContext &context) const
 {
-	if (!id) // extern function decl, no code generation needed
+	if (call.builtin != Builtin::None)
 	{
-		return nullptr;
+		return createAwaitIO(context, call);
 	}
 
-	auto &store = context.locals()[id->name];
+	auto &llvmContext = *context.llvmContext;
+	auto module = context.module.get();
+	auto task = call.codeGen(context);
+	auto type = promiseType(context, call.decl->type);
+	auto promise = createPromise(context, task, type);
+
+	auto builder = getBuilder(context);
+	builder.CreateCall(Intrinsic::getDeclaration(module, Intrinsic::coro_resume), {task});
+	auto function = context.currentBlock()->getParent();
+	auto wait = BasicBlock::Create(llvmContext, "await.wait", function);
+	auto ready = BasicBlock::Create(llvmContext, "await.ready");
+	builder.CreateCondBr(builder.CreateCall(Intrinsic::getDeclaration(module, Intrinsic::coro_done), {task}), ready, wait);
+
+	// destroyed while waiting, this task takes the one it waits for along
+	auto cleanup = BasicBlock::Create(llvmContext, "await.cleanup", function);
+	IRBuilder<>(cleanup).CreateCall(Intrinsic::getDeclaration(module, Intrinsic::coro_destroy), {task});
+	IRBuilder<>(cleanup).CreateBr(context.blocks.top().coroutine->cleanup);
+	context.ssa().sealBlock(cleanup);
 
-	store.node = this;
+	context.ssa().sealBlock(wait);
+	context.setInsertBlock(wait);
+	builder.SetInsertPoint(wait);
+	builder.CreateStore(context.blocks.top().coroutine->handle, builder.CreateStructGEP(type, promise, 0));
+	createSuspend(context, ready, cleanup);
 
-	if (rhs == nullptr)
+	ready->insertInto(function);
+	context.ssa().sealBlock(ready);
+	context.setInsertBlock(ready);
+	builder.SetInsertPoint(ready);
+	Value *result = nullptr;
+	if (call.decl->type)
+	{
+		result = builder.CreateLoad(builder.CreateStructGEP(type, promise, 2), call.id.name);
+	}
+
+	builder.CreateCall(Intrinsic::getDeclaration(module, Intrinsic::coro_destroy), {task});
+	return result;
+}
+
+Value *SpawnStatement::codeGen(CodeGenContext &context) const
+{
+	auto task = call.codeGen(context);
+	auto type = promiseType(context, call.decl->type);
+	auto promise = createPromise(context, task, type);
+
+	auto builder = getBuilder(context);
+	builder.CreateStore(builder.getTrue(), builder.CreateStructGEP(type, promise, 1));
+	builder.CreateCall(context.module->getOrInsertFunction("wf_task_ready", builder.getVoidTy(), builder.getInt8PtrTy()), {task});
+	return nullptr;
+}
+
+// A stack slot, or with --ssa an SSA variable, for decl in the current function, set to value if not null
+Value *declareLocal(CodeGenContext &context, const VariableDeclaration &decl, Type *type, Value *value)
+{
+	auto &store = context.locals()[decl.id->symbol];
+	store.node = &decl;
+
+	if (context.options.directSSA && !decl.addressTaken)
+	{
+		store.value = nullptr;
+		context.ssa().declare(decl.id->symbol, type);
+		if (value)
+		{
+			if (!value->hasName())
+			{
+				value->setName(decl.id->name);
+			}
+
+			context.ssa().writeVariable(decl.id->symbol, context.currentBlock(), value);
+		}
+
+		return value;
+	}
+
+	store.value = createEntryAlloca(context, type, decl.id->name);
+	if (!value)
 	{
-		store.value = getBuilder(context).CreateAlloca(typeOf(*type), nullptr, id->name);
 		return store.value;
 	}
 
-	Value *rhsResult = rhs->codeGen(context);
-	store.value = getBuilder(context).CreateAlloca(type ? typeOf(*type) : rhsResult->getType(), nullptr, id->name);
-	return getBuilder(context).CreateStore(rhsResult, store.value);
+	return getBuilder(context).CreateStore(value, store.value);
+}
+
+Value *VariableDeclaration::codeGen(CodeGenContext &context) const
+{
+	if (!id) // extern function decl, no code generation needed
+	{
+		return nullptr;
+	}
+
+	Value *rhsResult = rhs ? rhs->codeGen(context) : nullptr;
+	return declareLocal(context, *this, type ? typeOf(context, *type) : rhsResult->getType(), rhsResult);
 }
 
 Value *ExpressionStatement::codeGen(CodeGenContext &context) const
@@ -342,25 +1155,445 @@ Value *ArgumentList::codeGen(CodeGenContext &context) const
 	{
 		result = arg->codeGen(context);
 		result->setName(arg->id->name);
-		getBuilder(context).CreateStore(context.locals()[arg->id->name].value, result);
+		getBuilder(context).CreateStore(context.locals()[arg->id->symbol].value, result);
 	}
 
 	return result;
 }
 
+void createRegionLeave(CodeGenContext &context, unsigned count)
+{
+	auto builder = getBuilder(context);
+	auto leave = context.module->getOrInsertFunction("wf_region_leave", builder.getVoidTy());
+	for (unsigned i = 0; i < count; i++)
+	{
+		builder.CreateCall(leave);
+	}
+}
+
+Value *RegionStatement::codeGen(CodeGenContext &context) const
+{
+	auto builder = getBuilder(context);
+	builder.CreateCall(context.module->getOrInsertFunction("wf_region_enter", builder.getVoidTy()));
+
+	context.blocks.top().regions++;
+	block.codeGen(context);
+	context.blocks.top().regions--;
+
+	if (context.currentBlock()->getTerminator() == nullptr)
+	{
+		createRegionLeave(context, 1);
+	}
+
+	return nullptr;
+}
+
+// Turns a number into the i1 a branch needs, a comparison gives its own result back
+Value *createCondition(CodeGenContext &context, const Expression &condition)
+{
+	auto value = condition.codeGen(context);
+	auto zext = dyn_cast<ZExtInst>(value);
+	if (zext && zext->getSrcTy()->isIntegerTy(1) && dynamic_cast<const Node::BinaryOperator *>(&condition))
+	{
+		auto compare = zext->getOperand(0);
+		zext->eraseFromParent(); // just created for this comparison, nothing else refers to it
+		return compare;
+	}
+
+	auto builder = getBuilder(context);
+	if (value->getType()->isFloatingPointTy())
+	{
+		return builder.CreateFCmpUNE(value, ConstantFP::get(value->getType(), 0.0));
+	}
+
+	return builder.CreateICmpNE(value, ConstantInt::get(value->getType(), 0));
+}
+
+// !llvm.loop with the #pragma hints, attached to the latch branch
+MDNode *createLoopHints(LLVMContext &llvmContext, unsigned unroll, unsigned vectorize)
+{
+	SmallVector<Metadata *, 4> operands{nullptr}; // the loop id refers to itself
+	auto hint = [&](const char *name, Constant *value) {
+		operands.push_back(MDNode::get(llvmContext, {MDString::get(llvmContext, name), ConstantAsMetadata::get(value)}));
+	};
+
+	if (unroll)
+	{
+		hint("llvm.loop.unroll.count", ConstantInt::get(Type::getInt32Ty(llvmContext), unroll));
+	}
+	if (vectorize)
+	{
+		hint("llvm.loop.vectorize.width", ConstantInt::get(Type::getInt32Ty(llvmContext), vectorize));
+		hint("llvm.loop.vectorize.enable", ConstantInt::get(Type::getInt1Ty(llvmContext), vectorize > 1));
+	}
+
+	auto loop = MDNode::getDistinct(llvmContext, operands);
+	loop->replaceOperandWith(0, loop);
+	return loop;
+}
+
+bool LoopStatement::hint(const Identifier &pragma, uint64_t value)
+{
+	if (pragma.name == "unroll")
+	{
+		unroll = value;
+		return true;
+	}
+	if (pragma.name == "vectorize")
+	{
+		vectorize = value;
+		return true;
+	}
+
+	return false;
+}
+
+Value *LoopStatement::codeGen(CodeGenContext &context) const
+{
+	auto &llvmContext = *context.llvmContext;
+	auto function = context.currentBlock()->getParent();
+
+	if (init)
+	{
+		init->codeGen(context);
+	}
+
+	// the current block is the preheader; latch and exit are placed after the body's blocks
+	auto header = BasicBlock::Create(llvmContext, "loop.header", function);
+	auto bodyBlock = BasicBlock::Create(llvmContext, "loop.body", function);
+	auto latch = BasicBlock::Create(llvmContext, "loop.latch");
+	auto exit = BasicBlock::Create(llvmContext, "loop.exit");
+	getBuilder(context).CreateBr(header);
+
+	context.setInsertBlock(header);
+	auto test = createCondition(context, condition);
+	auto always = dyn_cast<ConstantInt>(test);
+	if (always && always->isOne()) // while 1: only a break reaches the exit
+	{
+		getBuilder(context).CreateBr(bodyBlock);
+	}
+	else
+	{
+		getBuilder(context).CreateCondBr(test, bodyBlock, exit);
+	}
+	context.ssa().sealBlock(bodyBlock);
+
+	auto &current = context.blocks.top();
+	context.setInsertBlock(bodyBlock);
+	current.loops.push_back(LoopTarget{exit : exit, latch : latch, regions : current.regions});
+	body.codeGen(context);
+	current.loops.pop_back();
+
+	if (context.currentBlock()->getTerminator() == nullptr)
+	{
+		getBuilder(context).CreateBr(latch);
+	}
+
+	latch->insertInto(function);
+	context.ssa().sealBlock(latch); // every continue is known now
+	context.setInsertBlock(latch);
+	if (step)
+	{
+		step->codeGen(context);
+	}
+
+	auto backedge = getBuilder(context).CreateBr(header);
+	if (unroll || vectorize)
+	{
+		backedge->setMetadata(LLVMContext::MD_loop, createLoopHints(llvmContext, unroll, vectorize));
+	}
+
+	context.ssa().sealBlock(header);
+	exit->insertInto(function);
+	context.ssa().sealBlock(exit);
+	context.setInsertBlock(exit);
+	return nullptr;
+}
+
+// 0 for a sum, 1 for a product, in every lane of a vector
+Constant *createIdentity(Type *type, int op)
+{
+	if (op == PLUS)
+	{
+		return Constant::getNullValue(type);
+	}
+
+	return type->isFPOrFPVectorTy() ? ConstantFP::get(type, 1.0) : ConstantInt::get(type, 1);
+}
+
+// The body of a parallel for as void (i8 *env, i64 begin, i64 end, i64 chunk), running the iterations
+// begin..end-1 in a loop of its own. env holds the captured values, followed by the array of results
+// of the chunks for a reduction.
+Function *createParallelBody(CodeGenContext &context, const ParallelFor &loop, StructType *envType, Type *resultType)
+{
+	auto &llvmContext = *context.llvmContext;
+	auto int64 = Type::getInt64Ty(llvmContext);
+	auto ftype = FunctionType::get(Type::getVoidTy(llvmContext), {Type::getInt8PtrTy(llvmContext), int64, int64, int64}, false);
+	auto function = Function::Create(ftype, GlobalValue::InternalLinkage, "parallel.body", context.module.get());
+	function->addParamAttr(0, Attribute::NoAlias);
+	function->addParamAttr(0, Attribute::ReadOnly);
+
+	auto entry = BasicBlock::Create(llvmContext, "entry", function);
+	context.pushBlock(entry);
+	context.ssa().sealBlock(entry);
+
+	auto arg = function->arg_begin();
+	auto builder = getBuilder(context);
+	auto env = builder.CreateBitCast(arg++, envType->getPointerTo(), "env");
+	Value *begin = arg++, *end = arg++, *chunk = arg++;
+	begin->setName("begin");
+	end->setName("end");
+	chunk->setName("chunk");
+
+	// captured variables are locals of the body set from env, so the body can redeclare their names;
+	// Sema keeps it from assigning them
+	for (unsigned i = 0; i < loop.captures.size(); i++)
+	{
+		auto decl = loop.captures[i];
+		auto value = builder.CreateLoad(builder.CreateStructGEP(envType, env, i), decl->id->name);
+		declareLocal(context, *decl, value->getType(), value);
+	}
+
+	// nothing the body allocates outlives its iteration, the chunk is run in a region on the worker's own allocator
+	builder.CreateCall(context.module->getOrInsertFunction("wf_region_enter", builder.getVoidTy()));
+
+	AllocaInst *accumulator = nullptr;
+	if (resultType)
+	{
+		accumulator = createEntryAlloca(context, resultType, loop.op == PLUS ? "sum" : "product");
+		builder.CreateStore(createIdentity(resultType, loop.op), accumulator);
+	}
+
+	declareLocal(context, loop.index, int64, begin);
+	auto header = BasicBlock::Create(llvmContext, "loop.header", function);
+	auto bodyBlock = BasicBlock::Create(llvmContext, "loop.body", function);
+	auto latch = BasicBlock::Create(llvmContext, "loop.latch");
+	auto exit = BasicBlock::Create(llvmContext, "loop.exit");
+	getBuilder(context).CreateBr(header);
+
+	context.setInsertBlock(header);
+	auto index = readVariable(context, loop.index);
+	auto test = getBuilder(context).CreateICmpSLT(index, end);
+	getBuilder(context).CreateCondBr(test, bodyBlock, exit);
+	context.ssa().sealBlock(bodyBlock);
+
+	auto &current = context.blocks.top();
+	context.setInsertBlock(bodyBlock);
+	current.loops.push_back(LoopTarget{exit : nullptr, latch : latch, regions : current.regions});
+	auto value = loop.body.codeGen(context);
+	current.loops.pop_back();
+
+	if (context.currentBlock()->getTerminator() == nullptr)
+	{
+		if (accumulator)
+		{
+			auto sum = getBuilder(context).CreateLoad(accumulator);
+			getBuilder(context).CreateStore(createArithmeticOp(context, sum, value, loop.op), accumulator);
+		}
+
+		getBuilder(context).CreateBr(latch);
+	}
+
+	latch->insertInto(function);
+	context.ssa().sealBlock(latch);
+	context.setInsertBlock(latch);
+	index = readVariable(context, loop.index);
+	writeLocal(context, *loop.index.id, getBuilder(context).CreateNSWAdd(index, ConstantInt::get(int64, 1)));
+	getBuilder(context).CreateBr(header);
+
+	context.ssa().sealBlock(header);
+	exit->insertInto(function);
+	context.ssa().sealBlock(exit);
+	context.setInsertBlock(exit);
+
+	builder.SetInsertPoint(exit);
+	if (accumulator)
+	{
+		auto results = builder.CreateLoad(builder.CreateStructGEP(envType, env, loop.captures.size()), "results");
+		builder.CreateStore(builder.CreateLoad(accumulator), builder.CreateInBoundsGEP(resultType, results, chunk));
+	}
+
+	createRegionLeave(context, 1);
+	getBuilder(context).CreateRetVoid();
+	context.popBlock();
+	return function;
+}
+
+Value *ParallelFor::codeGen(CodeGenContext &context) const
+{
+	auto &llvmContext = *context.llvmContext;
+	auto &module = *context.module;
+	auto int64 = Type::getInt64Ty(llvmContext);
+
+	auto low = index.rhs->codeGen(context);
+	auto limit = high.codeGen(context);
+	Value *chunkSize = grain ? grain->codeGen(context) : ConstantInt::get(int64, 0);
+
+	vector<Value *> values;
+	vector<Type *> fields;
+	for (auto decl : captures)
+	{
+		values.push_back(readVariable(context, *decl));
+		fields.push_back(values.back()->getType());
+	}
+
+	auto resultType = op ? numericType(context, resolvedType) : nullptr;
+	if (resultType)
+	{
+		fields.push_back(resultType->getPointerTo());
+	}
+
+	auto envType = StructType::get(llvmContext, fields);
+	auto body = createParallelBody(context, *this, envType, resultType);
+
+	auto builder = getBuilder(context);
+	auto env = createEntryAlloca(context, envType, "env");
+	Value *chunks = nullptr;
+	Value *results = nullptr;
+	if (resultType)
+	{
+		// one result per chunk, in a region left once they are combined
+		chunkSize = builder.CreateCall(module.getOrInsertFunction("wf_parallel_grain", int64, int64, int64, int64), {low, limit, chunkSize}, "grain");
+		chunks = builder.CreateCall(module.getOrInsertFunction("wf_parallel_chunks", int64, int64, int64, int64), {low, limit, chunkSize}, "chunks");
+		builder.CreateCall(module.getOrInsertFunction("wf_region_enter", builder.getVoidTy()));
+
+		auto size = builder.CreateMul(chunks, ConstantExpr::getSizeOf(resultType));
+		auto memory = builder.CreateCall(module.getOrInsertFunction("wf_alloc", builder.getInt8PtrTy(), int64), {size});
+		results = builder.CreateBitCast(memory, resultType->getPointerTo(), "results");
+		values.push_back(results);
+	}
+
+	for (unsigned i = 0; i < values.size(); i++)
+	{
+		builder.CreateStore(values[i], builder.CreateStructGEP(envType, env, i));
+	}
+
+	auto run = module.getOrInsertFunction("wf_parallel_for", builder.getVoidTy(), body->getType(), builder.getInt8PtrTy(), int64, int64, int64);
+	builder.CreateCall(run, {body, builder.CreateBitCast(env, builder.getInt8PtrTy()), low, limit, chunkSize});
+	if (!resultType)
+	{
+		return nullptr;
+	}
+
+	// the results of the chunks in the order of the range, whichever thread ran them
+	auto function = context.currentBlock()->getParent();
+	auto preheader = context.currentBlock();
+	auto combine = BasicBlock::Create(llvmContext, "parallel.combine", function);
+	auto done = BasicBlock::Create(llvmContext, "parallel.done", function);
+	auto identity = createIdentity(resultType, op);
+	builder.CreateCondBr(builder.CreateICmpSGT(chunks, ConstantInt::get(int64, 0)), combine, done);
+
+	context.setInsertBlock(combine);
+	builder.SetInsertPoint(combine);
+	auto position = builder.CreatePHI(int64, 2, "chunk");
+	auto partial = builder.CreatePHI(resultType, 2);
+	auto result = builder.CreateLoad(builder.CreateInBoundsGEP(resultType, results, position));
+	auto combined = createArithmeticOp(context, partial, result, op);
+	auto next = builder.CreateNSWAdd(position, ConstantInt::get(int64, 1));
+	builder.CreateCondBr(builder.CreateICmpSLT(next, chunks), combine, done);
+	position->addIncoming(ConstantInt::get(int64, 0), preheader);
+	position->addIncoming(next, combine);
+	partial->addIncoming(identity, preheader);
+	partial->addIncoming(combined, combine);
+	context.ssa().sealBlock(combine);
+
+	context.setInsertBlock(done);
+	context.ssa().sealBlock(done);
+	builder.SetInsertPoint(done);
+	auto total = builder.CreatePHI(resultType, 2, op == PLUS ? "sum" : "product");
+	total->addIncoming(identity, preheader);
+	total->addIncoming(combined, combine);
+	createRegionLeave(context, 1);
+	return total;
+}
+
+Value *IfStatement::codeGen(CodeGenContext &context) const
+{
+	auto &llvmContext = *context.llvmContext;
+	auto function = context.currentBlock()->getParent();
+
+	auto thenBlock = BasicBlock::Create(llvmContext, "if.then", function);
+	auto elseBlock = otherwise ? BasicBlock::Create(llvmContext, "if.else") : nullptr;
+	auto merge = BasicBlock::Create(llvmContext, "if.end");
+	auto test = createCondition(context, condition);
+	getBuilder(context).CreateCondBr(test, thenBlock, elseBlock ? elseBlock : merge);
+
+	auto generate = [&](BasicBlock *block, const Block &statements) {
+		context.ssa().sealBlock(block);
+		context.setInsertBlock(block);
+		statements.codeGen(context);
+
+		if (context.currentBlock()->getTerminator() == nullptr)
+		{
+			getBuilder(context).CreateBr(merge);
+		}
+	};
+
+	generate(thenBlock, then);
+	if (otherwise)
+	{
+		elseBlock->insertInto(function);
+		generate(elseBlock, *otherwise);
+	}
+
+	if (pred_empty(merge)) // both sides returned, broke or continued: the statement ends the block
+	{
+		delete merge;
+		return nullptr;
+	}
+
+	merge->insertInto(function);
+	context.ssa().sealBlock(merge);
+	context.setInsertBlock(merge);
+	return nullptr;
+}
+
+Value *BranchStatement::codeGen(CodeGenContext &context) const
+{
+	auto &current = context.blocks.top();
+	if (current.loops.empty())
+	{
+		throw runtime_error(token == BREAK ? "break outside of a loop" : "continue outside of a loop");
+	}
+
+	auto &loop = current.loops.back();
+	if (token == BREAK && !loop.exit)
+	{
+		throw runtime_error("break out of a parallel for");
+	}
+
+	createRegionLeave(context, current.regions - loop.regions);
+	return getBuilder(context).CreateBr(token == BREAK ? loop.exit : loop.latch);
+}
+
 Value *ReturnStatement::codeGen(CodeGenContext &context) const
 {
-	return getBuilder(context).CreateRet(rhs.codeGen(context));
+	auto value = rhs.codeGen(context);
+	createRegionLeave(context, context.blocks.top().regions); // a string returned from inside a region does not outlive it
+
+	if (auto &coroutine = context.blocks.top().coroutine)
+	{
+		auto builder = getBuilder(context);
+		auto type = coroutine->promise->getAllocatedType();
+		if (type->getStructNumElements() > 2)
+		{
+			builder.CreateStore(value, builder.CreateStructGEP(type, coroutine->promise, 2));
+		}
+
+		return builder.CreateBr(coroutine->final);
+	}
+
+	return getBuilder(context).CreateRet(value);
 }
 
 Value *AddressOf::codeGen(CodeGenContext &context) const
 {
-	if (auto arg = context.args().find(ident->name))
+	if (auto arg = context.args().find(ident->symbol))
 	{
 		return arg->value;
 	}
 
-	if (auto local = context.locals().find(ident->name))
+	if (auto local = context.locals().find(ident->symbol))
 	{
 		return local->value;
 	}
@@ -2,6 +2,7 @@
 #include <iostream>
 #include <vector>
 #include <optional>
+#include <string_view>
 #include <map>
 
 #include <llvm/IR/Value.h>
@@ -9,6 +10,7 @@
 #include "codegen.hpp"
 
 struct CodeGenContext;
+struct Sema;
 
 namespace Node
 {
@@ -17,32 +19,57 @@ struct Expression;
 struct VariableDeclaration;
 struct Identifier;
 struct ArgumentList;
+struct FunctionDeclaration;
 
 using StatementList = std::vector<Statement *>;
 using ExpressionList = std::vector<Expression *>;
 
-extern llvm::LLVMContext GlobalContext;
-
 enum class InternalType
 {
 	Invalid,
 	Integer,
 	Float,
 	String,
+	IntSlice,
+	FloatSlice,
+	Int4,
+	Int8,
+	Float4,
+	Float8,
 };
 
-llvm::Type *typeOf(const Identifier &type);
+llvm::Type *typeOf(CodeGenContext &context, const Identifier &type);
 InternalType typeOf2(const Identifier &type);
+unsigned lanesOf(InternalType type); // 0 for anything but vectors
+InternalType scalarOf(InternalType type); // the lane type of a vector
+
+// Functions the compiler provides, used when the program declares no function of that name
+enum class Builtin
+{
+	None,
+	Vector, // int4(a, b, c, d) or int4(splat), named after the type
+	Shuffle,
+	ReduceAdd,
+	ReduceMul,
+	ReduceMin,
+	ReduceMax,
+	Load,
+	Store,
+	Read,  // await read(fd, max), only under await
+	Write, // await write(fd, s)
+	Sleep, // await sleep(ms)
+};
 
 struct NodeBase
 {
 	virtual ~NodeBase() {}
 	virtual llvm::Value *codeGen(CodeGenContext &context) const = 0;
+	virtual void resolve(Sema &sema) = 0;
 };
 
 struct Expression : NodeBase
 {
-	virtual InternalType GetType(CodeGenContext &context) const = 0;
+	InternalType resolvedType = InternalType::Invalid; // filled in by Sema
 };
 
 struct Statement : NodeBase
@@ -58,10 +85,7 @@ struct Integer : Numeric
 	uint64_t value;
 	Integer(uint64_t value) : value(value) {}
 	virtual llvm::Value *codeGen(CodeGenContext &context) const override;
-	virtual InternalType GetType(CodeGenContext &context) const override
-	{
-		return InternalType::Integer;
-	}
+	virtual void resolve(Sema &sema) override;
 };
 
 struct Float : Numeric
@@ -69,68 +93,86 @@ struct Float : Numeric
 	double value;
 	Float(double value) : value(value) {}
 	virtual llvm::Value *codeGen(CodeGenContext &context) const override;
-	virtual InternalType GetType(CodeGenContext &context) const override
-	{
-		return InternalType::Float;
-	}
+	virtual void resolve(Sema &sema) override;
 };
 
 struct String : Expression
 {
-	std::string value;
-	String(const std::string &value) : value(value) {}
+	std::string_view value; // into the program source or the arena, both outlive code generation
+	String(std::string_view value) : value(value) {}
 	virtual llvm::Value *codeGen(CodeGenContext &context) const override;
-	virtual InternalType GetType(CodeGenContext &context) const override
-	{
-		return InternalType::String;
-	}
+	virtual void resolve(Sema &sema) override;
 };
 
 struct Identifier : Expression
 {
-	std::string name;
-	Identifier(const std::string &name) : name(name) {}
+	Symbol symbol;
+	const std::string &name;
+	const VariableDeclaration *decl = nullptr; // bound by Sema when used as an expression
+	Identifier(std::string_view name) : symbol(symbols().intern(name)), name(symbols().name(symbol)) {}
 	virtual llvm::Value *codeGen(CodeGenContext &context) const override;
-	virtual InternalType GetType(CodeGenContext &context) const override
-	{
-		auto ident = context.args().find(name);
-		if (!ident)
-		{
-			return InternalType::Invalid;
-		}
-
-		auto expr = dynamic_cast<const Expression *>(ident->node);
-		if (!expr)
-		{
-			return InternalType::Invalid;
-		}
-
-		return expr->GetType(context);
-	}
+	virtual void resolve(Sema &sema) override;
 };
 
 struct MethodCall : Expression
 {
 	const Identifier &id;
 	const ExpressionList &args;
+	const FunctionDeclaration *decl = nullptr; // bound by Sema
+	Builtin builtin = Builtin::None;		   // bound by Sema instead of decl
+	bool task = false;						   // under await or spawn, which an async function or I/O needs
 	MethodCall(const Identifier &id, const ExpressionList &args = ExpressionList()) : id(id), args(args) {}
 	virtual llvm::Value *codeGen(CodeGenContext &context) const override;
-	virtual InternalType GetType(CodeGenContext &context) const override
-	{
-		auto ident = context.functions.find(id.name);
-		if (!ident)
-		{
-			return InternalType::Invalid;
-		}
+	virtual void resolve(Sema &sema) override;
+};
+
+// []int(n): n zeroed elements from the current region
+struct SliceAllocation : Expression
+{
+	const Identifier &type;
+	Expression &length;
+	SliceAllocation(const Identifier &type, Expression &length) : type(type), length(length) {}
+	virtual llvm::Value *codeGen(CodeGenContext &context) const override;
+	virtual void resolve(Sema &sema) override;
+};
+
+struct ArrayIndex : Expression
+{
+	Identifier &array;
+	Expression &index;
+	ArrayIndex(Identifier &array, Expression &index) : array(array), index(index) {}
+	virtual llvm::Value *codeGen(CodeGenContext &context) const override;
+	virtual void resolve(Sema &sema) override;
+};
 
-		auto expr = dynamic_cast<const Expression *>(ident->node);
-		if (!expr)
-		{
-			return InternalType::Invalid;
-		}
+struct ArrayAssignment : Expression
+{
+	Identifier &array;
+	Expression &index;
+	Expression &rhs;
+	ArrayAssignment(Identifier &array, Expression &index, Expression &rhs) : array(array), index(index), rhs(rhs) {}
+	virtual llvm::Value *codeGen(CodeGenContext &context) const override;
+	virtual void resolve(Sema &sema) override;
+};
+
+// a[low:high], shares the elements of a
+struct SubSlice : Expression
+{
+	Identifier &array;
+	Expression &low;
+	Expression &high;
+	SubSlice(Identifier &array, Expression &low, Expression &high) : array(array), low(low), high(high) {}
+	virtual llvm::Value *codeGen(CodeGenContext &context) const override;
+	virtual void resolve(Sema &sema) override;
+};
 
-		return expr->GetType(context);
-	}
+// len(x) of a slice or string
+struct Length : Expression
+{
+	Expression &operand;
+	Length(Expression &operand) : operand(operand) {}
+	virtual llvm::Value *codeGen(CodeGenContext &context) const override;
+	virtual void resolve(Sema &sema) override;
 };
 
 struct BinaryOperator : Expression
@@ -140,18 +182,7 @@ struct BinaryOperator : Expression
 	Expression *rhs;
 	BinaryOperator(Expression *lhs, int op, Expression *rhs) : op(op), lhs(lhs), rhs(rhs) {}
 	virtual llvm::Value *codeGen(CodeGenContext &context) const override;
-	virtual InternalType GetType(CodeGenContext &context) const override
-	{
-		auto left = lhs->GetType(context);
-		auto right = rhs->GetType(context);
-
-		if (left != right)
-		{
-			return InternalType::Invalid;
-		}
-
-		return left;
-	}
+	virtual void resolve(Sema &sema) override;
 };
 
 struct Assignment : Expression
@@ -160,10 +191,7 @@ struct Assignment : Expression
 	Expression &rhs;
 	Assignment(const Identifier &lhs, Expression &rhs) : lhs(lhs), rhs(rhs) {}
 	virtual llvm::Value *codeGen(CodeGenContext &context) const override;
-	virtual InternalType GetType(CodeGenContext &context) const override
-	{
-		return rhs.GetType(context);
-	}
+	virtual void resolve(Sema &sema) override;
 };
 
 struct Block : Statement
@@ -171,6 +199,85 @@ struct Block : Statement
 	StatementList stmts;
 	Block() {}
 	virtual llvm::Value *codeGen(CodeGenContext &context) const override;
+	virtual void resolve(Sema &sema) override;
+};
+
+// region { ... }: everything the block allocates through wf_alloc is released when it is left
+struct RegionStatement : Statement
+{
+	Block &block;
+	RegionStatement(Block &block) : block(block) {}
+	virtual llvm::Value *codeGen(CodeGenContext &context) const override;
+	virtual void resolve(Sema &sema) override;
+};
+
+// while cond { } and for init; cond; step { }, lowered to preheader, header, body, a single latch and exit
+struct LoopStatement : Statement
+{
+	Statement *init;
+	Expression &condition;
+	Expression *step;
+	Block &body;
+	unsigned unroll = 0;	// #pragma unroll(n), 0 leaves it to the optimizer
+	unsigned vectorize = 0; // #pragma vectorize(n)
+	LoopStatement(Statement *init, Expression &condition, Expression *step, Block &body) : init(init), condition(condition), step(step), body(body) {}
+	bool hint(const Identifier &pragma, uint64_t value);
+	virtual llvm::Value *codeGen(CodeGenContext &context) const override;
+	virtual void resolve(Sema &sema) override;
+};
+
+// parallel for i := low : high { }: the body is outlined into a function the runtime's thread pool runs
+// over chunks of the range, reading the variables around it as copies. parallel + for ... { ...; x } sums
+// (or with *, multiplies) the values of the iterations, combined chunk by chunk in the order of the range.
+struct ParallelFor : Expression
+{
+	Expression *grain; // parallel(n) for, iterations per chunk; null leaves it to the runtime
+	int op;			   // PLUS or MUL, 0 for no reduction
+	VariableDeclaration &index;
+	Expression &high;
+	Block &body;
+	std::vector<const VariableDeclaration *> captures; // filled in by Sema
+	ParallelFor(Expression *grain, int op, VariableDeclaration &index, Expression &high, Block &body) : grain(grain), op(op), index(index), high(high), body(body) {}
+	virtual llvm::Value *codeGen(CodeGenContext &context) const override;
+	virtual void resolve(Sema &sema) override;
+};
+
+// await f(...) in an async function: runs the task of f, suspending until it is done, and gives its
+// result; await read/write/sleep(...) suspends on the event loop instead
+struct Await : Expression
+{
+	MethodCall &call;
+	Await(MethodCall &call) : call(call) {}
+	virtual llvm::Value *codeGen(CodeGenContext &context) const override;
+	virtual void resolve(Sema &sema) override;
+};
+
+// spawn f(...): hands the task of f to the event loop (wf_run) without waiting for it, it frees itself when done
+struct SpawnStatement : Statement
+{
+	MethodCall &call;
+	SpawnStatement(MethodCall &call) : call(call) {}
+	virtual llvm::Value *codeGen(CodeGenContext &context) const override;
+	virtual void resolve(Sema &sema) override;
+};
+
+struct IfStatement : Statement
+{
+	Expression &condition;
+	Block &then;
+	Block *otherwise;
+	IfStatement(Expression &condition, Block &then, Block *otherwise) : condition(condition), then(then), otherwise(otherwise) {}
+	virtual llvm::Value *codeGen(CodeGenContext &context) const override;
+	virtual void resolve(Sema &sema) override;
+};
+
+// break or continue, innermost loop
+struct BranchStatement : Statement
+{
+	int token;
+	BranchStatement(int token) : token(token) {}
+	virtual llvm::Value *codeGen(CodeGenContext &context) const override;
+	virtual void resolve(Sema &sema) override;
 };
 
 struct ExpressionStatement : Statement
@@ -178,13 +285,15 @@ struct ExpressionStatement : Statement
 	Expression &expr;
 	ExpressionStatement(Expression &expr) : expr(expr) {}
 	virtual llvm::Value *codeGen(CodeGenContext &context) const override;
+	virtual void resolve(Sema &sema) override;
 };
 
 struct ReturnStatement : Statement
 {
-	const Expression &rhs;
-	ReturnStatement(const Expression &rhs) : rhs(rhs) {}
+	Expression &rhs;
+	ReturnStatement(Expression &rhs) : rhs(rhs) {}
 	virtual llvm::Value *codeGen(CodeGenContext &context) const override;
+	virtual void resolve(Sema &sema) override;
 };
 
 struct VariableDeclaration : Statement
@@ -192,22 +301,25 @@ struct VariableDeclaration : Statement
 	const Identifier *type;
 	const Identifier *id;
 	Expression *rhs;
+	InternalType resolvedType = InternalType::Invalid; // filled in by Sema
+	mutable bool addressTaken = false;				   // set by Sema for &x, such a local keeps its stack slot with --ssa
+	unsigned regions = 0;							   // set by Sema: region statements open around it in its function
 	VariableDeclaration(Identifier *type, Identifier *id, Expression *rhs) : type(type), id(id), rhs(rhs) {}
 	virtual llvm::Value *codeGen(CodeGenContext &context) const override;
+	virtual void resolve(Sema &sema) override;
 };
 
 struct FunctionDeclaration : Expression, Statement
 {
 	const Identifier *type;
 	const Identifier *id;
-	const ArgumentList &args;
+	ArgumentList &args;
 	Block *block;
-	FunctionDeclaration(Identifier *type, Identifier *id, ArgumentList &args, Block *block) : type(type), id(id), args(args), block(block) {}
+	bool external; // a C function: strings cross the call as NUL-terminated char *
+	bool async;	   // a coroutine: a call returns its task, suspended before the body runs
+	FunctionDeclaration(Identifier *type, Identifier *id, ArgumentList &args, Block *block, bool external = false, bool async = false) : type(type), id(id), args(args), block(block), external(external), async(async) {}
 	virtual llvm::Value *codeGen(CodeGenContext &context) const override;
-	virtual InternalType GetType(CodeGenContext &context) const override
-	{
-		return type ? typeOf2(*type) : InternalType::Invalid;
-	}
+	virtual void resolve(Sema &sema) override;
 };
 
 struct ArgumentList : Statement
@@ -219,6 +331,7 @@ struct ArgumentList : Statement
 	auto end() const { return args.end(); }
 	void push_back(VariableDeclaration *x) { args.push_back(x); }
 	virtual llvm::Value *codeGen(CodeGenContext &context) const override;
+	virtual void resolve(Sema &sema) override;
 };
 
 struct AddressOf : Expression
@@ -226,9 +339,6 @@ struct AddressOf : Expression
 	const Identifier *ident;
 	AddressOf(Identifier *ident) : ident(ident) {}
 	virtual llvm::Value *codeGen(CodeGenContext &context) const override;
-	virtual InternalType GetType(CodeGenContext &context) const override
-	{
-		return InternalType::Invalid;
-	}
+	virtual void resolve(Sema &sema) override;
 };
 }; // namespace Node
\ No newline at end of file
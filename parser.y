@@ -1,15 +1,38 @@
+%code requires {
+	#include "parsestate.hpp"
+}
+
 %{
 	#include "node.hpp"
 	using namespace Node;
-	Block *programBlock;
 
-	extern int yylex();
-	void yyerror(const char *msg) { printf("Parse error: %s\n", msg); }
 	#ifdef _DEBUG
 	#define YYDEBUG 1
 	#endif
 %}
 
+%code {
+	extern int yylex(YYSTYPE *lvalp, yyscan_t scanner);
+	void yyerror(ParseState &state, yyscan_t scanner, const char *msg) { printf("Parse error: %s\n", msg); }
+
+	void ParseState::addTopLevel(Statement *stmt)
+	{
+		if (!onTopLevel)
+		{
+			programBlock->stmts.push_back(stmt);
+			return;
+		}
+
+		// lookahead tokens never allocate from the arena, so nothing past the mark is still in use
+		onTopLevel(*stmt);
+		arena.rollback(topLevelMark);
+	}
+}
+
+%define api.pure full
+%parse-param {ParseState &state} {yyscan_t scanner}
+%lex-param {yyscan_t scanner}
+
 %union {
 	Node::NodeBase *node;
 	Node::Block *block;
@@ -19,24 +42,31 @@
 	Node::VariableDeclaration *vardecl;
 	Node::ArgumentList *arglist;
 	Node::ExpressionList *exprlist;
-	std::string *string;
+	Node::LoopStatement *loop;
+	TokenText string;
+	uint64_t integer;
+	double number;
 	int token;
 }
 
 /* terminals */
-%token <string> IDENTIFIER INTEGER FLOAT STRING
-%token <token> EQ NE LT GT LE GE ASSIGN LET FUNC EXTERN RETURN
-%token <token> LPAREN RPAREN LBRACE RBRACE COMMA DOT ELLIPSIS
+%token <string> IDENTIFIER STRING
+%token <integer> INTEGER
+%token <number> FLOAT
+%token <token> EQ NE LT GT LE GE ASSIGN LET FUNC EXTERN RETURN REGION
+%token <token> WHILE FOR IF ELSE BREAK CONTINUE PRAGMA LEN PARALLEL ASYNC AWAIT SPAWN
+%token <token> LPAREN RPAREN LBRACE RBRACE LBRACKET RBRACKET COMMA DOT ELLIPSIS SEMICOLON COLON
 %token <token> PLUS MINUS MUL DIV AMP
 
 /* nonterminals */
 
-%type <ident> ident
-%type <expr> numeric expr string func_expr
+%type <ident> ident type slice_type
+%type <expr> numeric expr string func_expr parallel parallel_for
 %type <arglist> func_decl_args func_decl_arg_set
 %type <exprlist> call_args
-%type <block> program stmts block
-%type <stmt> stmt var_decl func_decl_arg func_decl
+%type <block> stmts block body
+%type <stmt> stmt var_decl func_decl_arg func_decl if_stmt for_init
+%type <loop> loop
 %type <token> binaryop
 
 /* precedence */
@@ -65,44 +95,89 @@
 
 %%
 
-program	: stmts	{ programBlock = $1; }
+program	: toplevel
 		;
 
-stmts	: stmt			{ $$ = new Block(); $$->stmts.push_back($1); }
+toplevel	: stmt				{ state.addTopLevel($1); }
+			| toplevel stmt		{ state.addTopLevel($2); }
+			;
+
+stmts	: stmt			{ $$ = state.arena.make<Block>(); $$->stmts.push_back($1); }
 		| stmts stmt	{ $1->stmts.push_back($2); }
 		;
 
 stmt	: var_decl
 		| func_decl
-		| RETURN expr %prec REDUCE	{ $$ = new ReturnStatement(*$2); }
-		| expr %prec REDUCE			{ $$ = new ExpressionStatement(*$1); }
+		| ASYNC func_decl			{ static_cast<FunctionDeclaration *>($2)->async = true; $$ = $2; }
+		| RETURN expr %prec REDUCE	{ $$ = state.arena.make<ReturnStatement>(*$2); }
+		| REGION block				{ $$ = state.arena.make<RegionStatement>(*$2); }
+		| loop						{ $$ = $1; }
+		| if_stmt
+		| BREAK						{ $$ = state.arena.make<BranchStatement>(BREAK); }
+		| CONTINUE					{ $$ = state.arena.make<BranchStatement>(CONTINUE); }
+		| SPAWN ident LPAREN call_args RPAREN	{ $$ = state.arena.make<SpawnStatement>(*state.arena.make<MethodCall>(*$2, *$4)); }
+		| expr %prec REDUCE			{ $$ = state.arena.make<ExpressionStatement>(*$1); }
 		;
 
 block	: LBRACE stmts RBRACE	{ $$ = $2; }
-		| LBRACE RBRACE			{ $$ = new Block(); }
-		| stmt					{ $$ = new Block(); $$->stmts.push_back($1); }
+		| LBRACE RBRACE			{ $$ = state.arena.make<Block>(); }
+		| stmt					{ $$ = state.arena.make<Block>(); $$->stmts.push_back($1); }
+		;
+
+body	: LBRACE stmts RBRACE	{ $$ = $2; }
+		| LBRACE RBRACE			{ $$ = state.arena.make<Block>(); }
 		;
 
-var_decl	: LET ident ident ASSIGN expr	{ $$ = new VariableDeclaration($3, $2, $5); }
-			| ident DECLAS expr				{ $$ = new VariableDeclaration(nullptr, $1, $3); }
+loop	: WHILE expr body										{ $$ = state.arena.make<LoopStatement>(nullptr, *$2, nullptr, *$3); }
+		| FOR for_init SEMICOLON expr SEMICOLON expr body		{ $$ = state.arena.make<LoopStatement>($2, *$4, $6, *$7); }
+		| PRAGMA ident LPAREN INTEGER RPAREN loop				{
+			if (!$6->hint(*$2, $4))
+			{
+				yyerror(state, scanner, "unknown loop pragma");
+				YYERROR;
+			}
+			$$ = $6;
+		}
+		;
+
+for_init	: var_decl
+			| expr		{ $$ = state.arena.make<ExpressionStatement>(*$1); }
 			;
 
-func_decl	: FUNC ident LPAREN func_decl_arg_set RPAREN ident block	{ $$ = new FunctionDeclaration($6, $2, *$4, $7); }
-			| FUNC ident LPAREN func_decl_arg_set RPAREN block			{ $$ = new FunctionDeclaration(nullptr, $2, *$4, $6); }
-			| FUNC ident LPAREN func_decl_arg_set RPAREN ident EXTERN	{ $$ = new FunctionDeclaration($6, $2, *$4, nullptr); }
-			| FUNC ident LPAREN func_decl_arg_set RPAREN EXTERN			{ $$ = new FunctionDeclaration(nullptr, $2, *$4, nullptr); }
+parallel	: PARALLEL						{ $$ = nullptr; }
+			| PARALLEL LPAREN expr RPAREN	{ $$ = $3; }
 			;
 
-func_expr	: FUNC LPAREN func_decl_arg_set RPAREN ident block	{ $$ = new FunctionDeclaration($5, nullptr, *$3, $6); }
-			| FUNC LPAREN func_decl_arg_set RPAREN block		{ $$ = new FunctionDeclaration(nullptr, nullptr, *$3, $5); }
+parallel_for	: parallel FOR ident DECLAS expr COLON expr body			{ $$ = state.arena.make<ParallelFor>($1, 0, *state.arena.make<VariableDeclaration>(nullptr, $3, $5), *$7, *$8); }
+				| parallel binaryop FOR ident DECLAS expr COLON expr body	{ $$ = state.arena.make<ParallelFor>($1, $2, *state.arena.make<VariableDeclaration>(nullptr, $4, $6), *$8, *$9); }
+				;
 
+if_stmt	: IF expr body				{ $$ = state.arena.make<IfStatement>(*$2, *$3, nullptr); }
+		| IF expr body ELSE body	{ $$ = state.arena.make<IfStatement>(*$2, *$3, $5); }
+		| IF expr body ELSE if_stmt	{ auto otherwise = state.arena.make<Block>(); otherwise->stmts.push_back($5); $$ = state.arena.make<IfStatement>(*$2, *$3, otherwise); }
+		;
+
+var_decl	: LET ident type ASSIGN expr	{ $$ = state.arena.make<VariableDeclaration>($3, $2, $5); }
+			| ident DECLAS expr				{ $$ = state.arena.make<VariableDeclaration>(nullptr, $1, $3); }
+			;
+
+func_decl	: FUNC ident LPAREN func_decl_arg_set RPAREN ident block	{ $$ = state.arena.make<FunctionDeclaration>($6, $2, *$4, $7); }
+			| FUNC ident LPAREN func_decl_arg_set RPAREN slice_type body	{ $$ = state.arena.make<FunctionDeclaration>($6, $2, *$4, $7); }
+			| FUNC ident LPAREN func_decl_arg_set RPAREN block			{ $$ = state.arena.make<FunctionDeclaration>(nullptr, $2, *$4, $6); }
+			| FUNC ident LPAREN func_decl_arg_set RPAREN ident EXTERN	{ $$ = state.arena.make<FunctionDeclaration>($6, $2, *$4, nullptr, true); }
+			| FUNC ident LPAREN func_decl_arg_set RPAREN EXTERN			{ $$ = state.arena.make<FunctionDeclaration>(nullptr, $2, *$4, nullptr, true); }
+			;
+
+func_expr	: FUNC LPAREN func_decl_arg_set RPAREN ident block	{ $$ = state.arena.make<FunctionDeclaration>($5, nullptr, *$3, $6); }
+			| FUNC LPAREN func_decl_arg_set RPAREN block		{ $$ = state.arena.make<FunctionDeclaration>(nullptr, nullptr, *$3, $5); }
 
-func_decl_arg	: ident ident	{ $$ = new VariableDeclaration($2, $1, nullptr); }
-				| ident			{ $$ = new VariableDeclaration($1, nullptr, nullptr); }
+
+func_decl_arg	: ident type	{ $$ = state.arena.make<VariableDeclaration>($2, $1, nullptr); }
+				| type			{ $$ = state.arena.make<VariableDeclaration>($1, nullptr, nullptr); }
 				;
 
-func_decl_args	: %empty								{ $$ = new ArgumentList(); }
-				| func_decl_arg							{ $$ = new ArgumentList(); $$->push_back($<vardecl>1); }
+func_decl_args	: %empty								{ $$ = state.arena.make<ArgumentList>(); }
+				| func_decl_arg							{ $$ = state.arena.make<ArgumentList>(); $$->push_back($<vardecl>1); }
 				| func_decl_args COMMA func_decl_arg	{ $1->push_back($<vardecl>3); }
 				;
 
@@ -110,32 +185,48 @@ func_decl_arg_set	: func_decl_args
 					| func_decl_args COMMA ELLIPSIS	{ $1->variadic = true; }
 					;
 
-ident	: IDENTIFIER	{ $$ = new Identifier(*$1); }
+ident	: IDENTIFIER	{ $$ = state.arena.make<Identifier>($1); }
+		;
+
+// A return type is spelled out as ident or slice_type in each rule, reducing it to type would clash with a
+// body that is an expression; a function returning a slice needs braces, []int(n) could be its body
+type	: ident
+		| slice_type
 		;
 
-numeric	: INTEGER						{ $$ = new Integer(atol($1->c_str())); }
-		| FLOAT							{ $$ = new Float(atof($1->c_str())); }
-		| MINUS INTEGER	%prec UMINUS	{ $$ = new Integer(-atol($2->c_str())); }
-		| MINUS FLOAT %prec UMINUS		{ $$ = new Float(-atof($2->c_str())); }
+slice_type	: LBRACKET RBRACKET ident	{ $$ = state.arena.make<Identifier>("[]" + $3->name); } // see Symbols::IntSlice
+			;
+
+numeric	: INTEGER						{ $$ = state.arena.make<Integer>($1); }
+		| FLOAT							{ $$ = state.arena.make<Float>($1); }
+		| MINUS INTEGER	%prec UMINUS	{ $$ = state.arena.make<Integer>(-$2); }
+		| MINUS FLOAT %prec UMINUS		{ $$ = state.arena.make<Float>(-$2); }
 		;
 
-string	: STRING %prec REDUCE	{ $$ = new String(*$1); }
+string	: STRING %prec REDUCE	{ $$ = state.arena.make<String>($1); }
 		// | STRING STRING			{ $$ = new String(std::string(*$1) + *$2); }
 		;
 
-expr	: ident ASSIGN expr					{ $$ = new Assignment(*$1, *$3); }
-		| ident LPAREN call_args RPAREN		{ $$ = new MethodCall(*$1, *$3); }
+expr	: ident ASSIGN expr					{ $$ = state.arena.make<Assignment>(*$1, *$3); }
+		| ident LPAREN call_args RPAREN		{ $$ = state.arena.make<MethodCall>(*$1, *$3); }
 		| ident	%prec REDUCE				{ $$ = $1; }
 		| numeric
 		| string
 		| func_expr
-		| expr binaryop expr %prec UMINUS	{ $$ = new BinaryOperator($1, $2, $3); }
+		| expr binaryop expr %prec UMINUS	{ $$ = state.arena.make<BinaryOperator>($1, $2, $3); }
 		| LPAREN expr RPAREN				{ $$ = $2; }
-		| AMP ident							{ $$ = new AddressOf($2); }
+		| AMP ident							{ $$ = state.arena.make<AddressOf>($2); }
+		| slice_type LPAREN expr RPAREN					{ $$ = state.arena.make<SliceAllocation>(*$1, *$3); }
+		| ident LBRACKET expr RBRACKET					{ $$ = state.arena.make<ArrayIndex>(*$1, *$3); }
+		| ident LBRACKET expr RBRACKET ASSIGN expr		{ $$ = state.arena.make<ArrayAssignment>(*$1, *$3, *$6); }
+		| ident LBRACKET expr COLON expr RBRACKET		{ $$ = state.arena.make<SubSlice>(*$1, *$3, *$5); }
+		| LEN LPAREN expr RPAREN						{ $$ = state.arena.make<Length>(*$3); }
+		| AWAIT ident LPAREN call_args RPAREN			{ $$ = state.arena.make<Await>(*state.arena.make<MethodCall>(*$2, *$4)); }
+		| parallel_for
 		;
 
-call_args	: %empty				{ $$ = new ExpressionList(); }
-			| expr %prec REDUCE		{ $$ = new ExpressionList(); $$->push_back($1); }
+call_args	: %empty				{ $$ = state.arena.make<ExpressionList>(); }
+			| expr %prec REDUCE		{ $$ = state.arena.make<ExpressionList>(); $$->push_back($1); }
 			| call_args COMMA expr	{ $1->push_back($3); }
 			;
 
@@ -0,0 +1,61 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "arena.hpp"
+#include "sourcebuffer.hpp"
+
+#ifndef YY_TYPEDEF_YY_SCANNER_T
+#define YY_TYPEDEF_YY_SCANNER_T
+typedef void *yyscan_t;
+#endif
+
+namespace Node
+{
+struct Block;
+struct Statement;
+} // namespace Node
+
+// Token text as the scanner hands it to the parser: a view into a SourceBuffer, or into
+// the arena for string literals with escapes. Trivial, so it can live in the bison union.
+struct TokenText
+{
+	const char *text;
+	size_t length;
+
+	operator std::string_view() const
+	{
+		return {text, length};
+	}
+};
+
+// Everything one parse owns. The scanner and parser are reentrant and keep no
+// globals, so several compilations can run on separate threads at once.
+struct ParseState
+{
+	Arena arena;	// owns every node of the program
+	Arena retained; // survives the rollbacks of streaming mode: literals with escapes, function signatures
+	Node::Block *programBlock = nullptr;
+	uint64_t tokenCount = 0;
+	std::vector<std::unique_ptr<SourceBuffer>> sources; // the program and its includes, tokens point into them
+	std::vector<std::string> modules; // precompiled .whm files pulled in by 'include', see module.hpp
+	size_t importedModules = 0;
+
+	// Streaming mode: called with each top-level statement as soon as it is parsed; the
+	// statement is then freed instead of being added to programBlock
+	std::function<void(Node::Statement &)> onTopLevel;
+	Arena::Mark topLevelMark{};
+
+	void addTopLevel(Node::Statement *stmt);
+
+	ParseState() = default;
+	ParseState(const ParseState &) = delete;
+	ParseState &operator=(const ParseState &) = delete;
+};
+
+// Parses a whole program from source into state.programBlock, which keeps the source alive; returns non-zero on error
+int parse(std::unique_ptr<SourceBuffer> source, ParseState &state);
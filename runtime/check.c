@@ -0,0 +1,11 @@
+/* Failure paths of the checks the compiler emits. Called only on the cold side of a branch. */
+#include "wfrt.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+void wf_bounds_fail(int64_t index, int64_t length)
+{
+	fprintf(stderr, "index %lld out of range for length %lld\n", (long long)index, (long long)length);
+	abort();
+}
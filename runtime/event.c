@@ -0,0 +1,439 @@
+/* Single-threaded event loop behind async functions. read, write and sleep try to finish at
+   once; when they cannot, the operation keeps the task that awaits it, epoll or the timer heap
+   tells the loop when it can go on, and the loop finishes it and resumes the task. Tasks are
+   resumed in the order they became ready. */
+#include "wfrt.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <unistd.h>
+
+struct operation
+{
+	struct operation *next;
+	void *task;
+	int fd;
+	char *data;
+	int64_t length; /* read: the most to read, write: the whole string */
+	int64_t done;	/* write: bytes written so far */
+	void *result;	/* wf_string * for read, int64_t * for write */
+};
+
+struct queue
+{
+	struct operation *head;
+	struct operation *tail;
+};
+
+/* the operations waiting on one file descriptor */
+struct watch
+{
+	struct queue readers;
+	struct queue writers;
+	uint32_t events; /* registered with epoll, 0 if not */
+	int checked; /* O_NONBLOCK made sure of since wf_run last returned */
+	int restore; /* the flags it had before, -1 if it was non-blocking already */
+};
+
+struct timer
+{
+	int64_t deadline; /* CLOCK_MONOTONIC milliseconds */
+	uint64_t sequence; /* timers due at once expire in the order they were set */
+	void *task;
+	int64_t *result;
+};
+
+static struct
+{
+	int epoll;
+	void **ready; /* ring of tasks to resume */
+	size_t head;
+	size_t count;
+	size_t capacity;
+	struct watch *watches; /* indexed by file descriptor */
+	size_t watchCount;
+	struct timer *timers; /* min-heap */
+	size_t timerCount;
+	size_t timerCapacity;
+	uint64_t sequence;
+	int64_t waiting; /* operations and timers not finished */
+} loop = {.epoll = -1};
+
+static void *grow(void *array, size_t *capacity, size_t size)
+{
+	size_t count = *capacity ? *capacity * 2 : 64;
+	array = realloc(array, count * size);
+	if (!array)
+	{
+		fprintf(stderr, "wf_run: out of memory\n");
+		abort();
+	}
+
+	*capacity = count;
+	return array;
+}
+
+void *wf_task_frame(int64_t size)
+{
+	void *frame = malloc(size);
+	if (!frame)
+	{
+		fprintf(stderr, "wf_run: out of memory\n");
+		abort();
+	}
+
+	return frame;
+}
+
+void wf_task_free(void *frame)
+{
+	free(frame);
+}
+
+/* A task is the handle of a coroutine as LLVM lowers them: its frame starts with a pointer to
+   the function that resumes it. */
+static void resume(void *task)
+{
+	(*(void (**)(void *))task)(task);
+}
+
+void wf_task_ready(void *task)
+{
+	if (!task)
+	{
+		return;
+	}
+
+	if (loop.count == loop.capacity)
+	{
+		size_t old = loop.capacity;
+		loop.ready = grow(loop.ready, &loop.capacity, sizeof(void *));
+		for (size_t i = 0; i < loop.head; i++) /* unwrap the ring into the new space */
+		{
+			loop.ready[(old + i) % loop.capacity] = loop.ready[i];
+		}
+	}
+
+	loop.ready[(loop.head + loop.count++) % loop.capacity] = task;
+}
+
+static int64_t now(void)
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (int64_t)time.tv_sec * 1000 + time.tv_nsec / 1000000;
+}
+
+static int before(const struct timer *a, const struct timer *b)
+{
+	return a->deadline < b->deadline || (a->deadline == b->deadline && a->sequence < b->sequence);
+}
+
+int64_t wf_sleep(void *task, int64_t milliseconds, int64_t *result)
+{
+	if (loop.timerCount == loop.timerCapacity)
+	{
+		loop.timers = grow(loop.timers, &loop.timerCapacity, sizeof(struct timer));
+	}
+
+	struct timer timer = {now() + (milliseconds > 0 ? milliseconds : 0), loop.sequence++, task, result};
+	size_t i = loop.timerCount++;
+	for (; i > 0 && before(&timer, &loop.timers[(i - 1) / 2]); i = (i - 1) / 2)
+	{
+		loop.timers[i] = loop.timers[(i - 1) / 2];
+	}
+
+	loop.timers[i] = timer;
+	loop.waiting++;
+	return 0; /* even sleep(0) lets the tasks that are ready run first */
+}
+
+static void expireTimers(void)
+{
+	int64_t time = now();
+	while (loop.timerCount && loop.timers[0].deadline <= time)
+	{
+		*loop.timers[0].result = 0;
+		wf_task_ready(loop.timers[0].task);
+		loop.waiting--;
+
+		struct timer last = loop.timers[--loop.timerCount];
+		size_t i = 0;
+		for (size_t child; (child = 2 * i + 1) < loop.timerCount; i = child)
+		{
+			if (child + 1 < loop.timerCount && before(&loop.timers[child + 1], &loop.timers[child]))
+			{
+				child++;
+			}
+			if (!before(&loop.timers[child], &last))
+			{
+				break;
+			}
+
+			loop.timers[i] = loop.timers[child];
+		}
+
+		loop.timers[i] = last;
+	}
+}
+
+static struct watch *watch(int fd)
+{
+	while ((size_t)fd >= loop.watchCount)
+	{
+		size_t old = loop.watchCount;
+		loop.watches = grow(loop.watches, &loop.watchCount, sizeof(struct watch));
+		for (size_t i = old; i < loop.watchCount; i++)
+		{
+			loop.watches[i] = (struct watch){{NULL, NULL}, {NULL, NULL}, 0, 0, 0};
+		}
+	}
+
+	struct watch *watch = &loop.watches[fd];
+	if (!watch->checked)
+	{
+		int flags = fcntl(fd, F_GETFL);
+		watch->restore = -1;
+		if (flags >= 0 && !(flags & O_NONBLOCK) && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0)
+		{
+			watch->restore = flags;
+		}
+
+		watch->checked = 1;
+	}
+
+	return watch;
+}
+
+/* Gives the descriptors back as the program had them, stdin and stdout above all */
+static void restoreFlags(void)
+{
+	for (size_t fd = 0; fd < loop.watchCount; fd++)
+	{
+		struct watch *watch = &loop.watches[fd];
+		if (watch->checked && watch->restore >= 0)
+		{
+			fcntl(fd, F_SETFL, watch->restore);
+		}
+
+		watch->checked = 0;
+	}
+}
+
+/* Each returns 1 once the operation is finished and its result stored, 0 if it would block */
+static int tryRead(struct operation *operation)
+{
+	ssize_t count;
+	do
+	{
+		count = read(operation->fd, operation->data, operation->length);
+	} while (count < 0 && errno == EINTR);
+
+	if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	{
+		return 0;
+	}
+
+	count = count < 0 ? 0 : count;
+	operation->data[count] = 0;
+	*(wf_string *)operation->result = (wf_string){operation->data, count};
+	return 1;
+}
+
+static int tryWrite(struct operation *operation)
+{
+	while (operation->done < operation->length)
+	{
+		ssize_t count = write(operation->fd, operation->data + operation->done, operation->length - operation->done);
+		if (count < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			return 0;
+		}
+		if (count < 0)
+		{
+			*(int64_t *)operation->result = -1;
+			return 1;
+		}
+
+		operation->done += count;
+	}
+
+	*(int64_t *)operation->result = operation->done;
+	return 1;
+}
+
+/* Registers with epoll for the operations still waiting on fd, 0 if it refuses */
+static int update(int fd)
+{
+	struct watch *watch = &loop.watches[fd];
+	uint32_t events = (watch->readers.head ? EPOLLIN : 0) | (watch->writers.head ? EPOLLOUT : 0);
+	if (events == watch->events)
+	{
+		return 1;
+	}
+
+	if (loop.epoll < 0 && (loop.epoll = epoll_create1(EPOLL_CLOEXEC)) < 0)
+	{
+		return 0;
+	}
+
+	struct epoll_event event = {.events = events, .data.fd = fd};
+	int op = !watch->events ? EPOLL_CTL_ADD : events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+	if (epoll_ctl(loop.epoll, op, fd, &event) < 0)
+	{
+		return 0;
+	}
+
+	watch->events = events;
+	return 1;
+}
+
+static int64_t start(struct queue *queue, struct operation operation, int (*attempt)(struct operation *))
+{
+	if (!queue->head && attempt(&operation)) /* behind others it waits its turn */
+	{
+		return 1;
+	}
+
+	struct operation *waiting = malloc(sizeof(struct operation));
+	if (!waiting)
+	{
+		fprintf(stderr, "wf_run: out of memory\n");
+		abort();
+	}
+
+	*waiting = operation;
+	if (queue->tail)
+	{
+		queue->tail->next = waiting;
+	}
+	else
+	{
+		queue->head = waiting;
+	}
+
+	queue->tail = waiting;
+	loop.waiting++;
+
+	if (!update(operation.fd))
+	{
+		fprintf(stderr, "wf_run: cannot wait for file descriptor %d\n", operation.fd);
+		abort();
+	}
+
+	return 0;
+}
+
+int64_t wf_read(void *task, int64_t fd, int64_t max, wf_string *result)
+{
+	if (fd < 0 || fd > INT_MAX) /* not a descriptor, fails like a read of a closed one */
+	{
+		*result = (wf_string){(char *)"", 0};
+		return 1;
+	}
+
+	max = max > 0 ? max : 0;
+	struct operation operation = {NULL, task, (int)fd, wf_alloc(max + 1), max, 0, result};
+	return start(&watch(fd)->readers, operation, tryRead);
+}
+
+int64_t wf_write(void *task, int64_t fd, const char *data, int64_t length, int64_t *result)
+{
+	if (fd < 0 || fd > INT_MAX)
+	{
+		*result = -1;
+		return 1;
+	}
+
+	struct operation operation = {NULL, task, (int)fd, (char *)data, length, 0, result};
+	return start(&watch(fd)->writers, operation, tryWrite);
+}
+
+static void drain(struct queue *queue, int (*attempt)(struct operation *))
+{
+	while (queue->head && attempt(queue->head))
+	{
+		struct operation *done = queue->head;
+		queue->head = done->next;
+		if (!queue->head)
+		{
+			queue->tail = NULL;
+		}
+
+		wf_task_ready(done->task);
+		loop.waiting--;
+		free(done);
+	}
+}
+
+int64_t wf_run(void)
+{
+	for (;;)
+	{
+		while (loop.count)
+		{
+			void *task = loop.ready[loop.head];
+			loop.head = (loop.head + 1) % loop.capacity;
+			loop.count--;
+			resume(task);
+		}
+
+		if (!loop.waiting)
+		{
+			restoreFlags();
+			return 0;
+		}
+
+		int timeout = -1;
+		if (loop.timerCount)
+		{
+			int64_t wait = loop.timers[0].deadline - now();
+			timeout = wait < 0 ? 0 : wait > INT_MAX ? INT_MAX : (int)wait;
+		}
+
+		struct epoll_event events[64];
+		int count = 0;
+		if (loop.epoll >= 0)
+		{
+			count = epoll_wait(loop.epoll, events, 64, timeout);
+		}
+		else if (timeout > 0)
+		{
+			struct timespec time = {timeout / 1000, (long)(timeout % 1000) * 1000000};
+			nanosleep(&time, NULL);
+		}
+
+		if (count < 0 && errno != EINTR)
+		{
+			restoreFlags();
+			return -1;
+		}
+
+		for (int i = 0; i < count; i++)
+		{
+			int fd = events[i].data.fd;
+			struct watch *watch = &loop.watches[fd];
+			if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+			{
+				drain(&watch->readers, tryRead);
+			}
+			if (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+			{
+				drain(&watch->writers, tryWrite);
+			}
+
+			update(fd);
+		}
+
+		expireTimers();
+	}
+}
@@ -0,0 +1,264 @@
+/* Work-stealing thread pool behind parallel for. A loop is cut into chunks of grain iterations,
+   the same chunks whatever the number of threads, so a reduction that combines the results of
+   the chunks in order gets the same result on any machine. Each thread taking part starts with
+   an equal share of the chunks and runs them from the front; one that is done steals the back
+   half of another thread's share, so uneven iterations still keep every thread busy. */
+#include "wfrt.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define MAX_THREADS 256
+#define DEFAULT_CHUNKS 256 /* chunks of a loop without a grain, plenty to balance over the threads */
+
+struct job
+{
+	wf_chunk_fn body;
+	void *env;
+	int64_t begin;
+	int64_t end;
+	int64_t grain;
+	int threads; /* taking part, the caller is thread 0 */
+};
+
+/* the chunks next..end-1 a thread has yet to run */
+struct share
+{
+	pthread_mutex_t lock;
+	int64_t next;
+	int64_t end;
+	unsigned long generation; /* the last job a worker has seen */
+} __attribute__((aligned(64)));
+
+static struct
+{
+	pthread_mutex_t lock; /* guards everything but the shares */
+	pthread_cond_t start;
+	pthread_cond_t done;
+	unsigned long generation; /* bumped for every job */
+	struct job job;
+	int workers; /* started so far, thread 1 and up */
+	int busy;	 /* workers still running the current job */
+} pool = {.lock = PTHREAD_MUTEX_INITIALIZER, .start = PTHREAD_COND_INITIALIZER, .done = PTHREAD_COND_INITIALIZER};
+
+static struct share shares[MAX_THREADS];
+static pthread_mutex_t serial = PTHREAD_MUTEX_INITIALIZER; /* one loop on the pool at a time */
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static int64_t defaultThreads;
+static int64_t defaultGrain;
+static int64_t threads;
+
+static _Thread_local int inside; /* running a chunk, a nested loop runs on this thread alone */
+
+static int64_t fromEnvironment(const char *name)
+{
+	const char *value = getenv(name);
+	return value ? atoll(value) : 0;
+}
+
+static void configure(void)
+{
+	defaultThreads = fromEnvironment("WF_THREADS");
+	if (defaultThreads <= 0)
+	{
+		defaultThreads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+
+	defaultThreads = defaultThreads < 1 ? 1 : defaultThreads > MAX_THREADS ? MAX_THREADS : defaultThreads;
+	defaultGrain = fromEnvironment("WF_GRAIN");
+	threads = defaultThreads;
+
+	for (int i = 0; i < MAX_THREADS; i++)
+	{
+		pthread_mutex_init(&shares[i].lock, NULL);
+	}
+}
+
+void wf_set_threads(int64_t n)
+{
+	pthread_once(&once, configure);
+	threads = n <= 0 ? defaultThreads : n > MAX_THREADS ? MAX_THREADS : n;
+}
+
+int64_t wf_threads(void)
+{
+	pthread_once(&once, configure);
+	return threads;
+}
+
+int64_t wf_parallel_grain(int64_t begin, int64_t end, int64_t grain)
+{
+	pthread_once(&once, configure);
+	if (grain > 0)
+	{
+		return grain;
+	}
+	if (defaultGrain > 0)
+	{
+		return defaultGrain;
+	}
+
+	int64_t iterations = end > begin ? end - begin : 0;
+	return iterations > DEFAULT_CHUNKS ? (iterations + DEFAULT_CHUNKS - 1) / DEFAULT_CHUNKS : 1;
+}
+
+int64_t wf_parallel_chunks(int64_t begin, int64_t end, int64_t grain)
+{
+	return end > begin ? (end - begin - 1) / grain + 1 : 0;
+}
+
+static void run(const struct job *job, int64_t chunk)
+{
+	int64_t first = job->begin + chunk * job->grain;
+	int64_t last = job->end - first > job->grain ? first + job->grain : job->end;
+	job->body(job->env, first, last, chunk);
+}
+
+static int64_t take(struct share *share)
+{
+	pthread_mutex_lock(&share->lock);
+	int64_t chunk = share->next < share->end ? share->next++ : -1;
+	pthread_mutex_unlock(&share->lock);
+	return chunk;
+}
+
+/* Moves the back half of the first share with work left to self's, which is empty. Only its
+   owner adds to a share, so once every share has been seen empty the job is out of work. */
+static int steal(int self, int count)
+{
+	for (int i = 1; i < count; i++)
+	{
+		struct share *victim = &shares[(self + i) % count];
+		pthread_mutex_lock(&victim->lock);
+		int64_t left = victim->end - victim->next;
+		if (left <= 0)
+		{
+			pthread_mutex_unlock(&victim->lock);
+			continue;
+		}
+
+		int64_t end = victim->end;
+		victim->end -= (left + 1) / 2;
+		int64_t next = victim->end;
+		pthread_mutex_unlock(&victim->lock);
+
+		pthread_mutex_lock(&shares[self].lock);
+		shares[self].next = next;
+		shares[self].end = end;
+		pthread_mutex_unlock(&shares[self].lock);
+		return 1;
+	}
+
+	return 0;
+}
+
+static void work(const struct job *job, int self)
+{
+	inside = 1;
+	do
+	{
+		int64_t chunk;
+		while ((chunk = take(&shares[self])) >= 0)
+		{
+			run(job, chunk);
+		}
+	} while (steal(self, job->threads));
+	inside = 0;
+}
+
+static void *worker(void *argument)
+{
+	int self = (int)(intptr_t)argument;
+
+	pthread_mutex_lock(&pool.lock);
+	for (;;)
+	{
+		while (shares[self].generation == pool.generation)
+		{
+			pthread_cond_wait(&pool.start, &pool.lock);
+		}
+
+		shares[self].generation = pool.generation;
+		if (self >= pool.job.threads)
+		{
+			continue;
+		}
+
+		struct job job = pool.job;
+		pthread_mutex_unlock(&pool.lock);
+		work(&job, self);
+		pthread_mutex_lock(&pool.lock);
+
+		if (--pool.busy == 0)
+		{
+			pthread_cond_signal(&pool.done);
+		}
+	}
+
+	return NULL;
+}
+
+/* Called with pool.lock held, gives up on threads the system will not create */
+static int spawn(int count)
+{
+	while (pool.workers < count - 1)
+	{
+		int self = pool.workers + 1;
+		pthread_t thread;
+		shares[self].generation = pool.generation;
+		if (pthread_create(&thread, NULL, worker, (void *)(intptr_t)self) != 0)
+		{
+			break;
+		}
+
+		pthread_detach(thread);
+		pool.workers++;
+	}
+
+	return pool.workers + 1 < count ? pool.workers + 1 : count;
+}
+
+void wf_parallel_for(wf_chunk_fn body, void *env, int64_t begin, int64_t end, int64_t grain)
+{
+	grain = wf_parallel_grain(begin, end, grain);
+	struct job job = {body, env, begin, end, grain, 1};
+	int64_t chunks = wf_parallel_chunks(begin, end, grain);
+
+	if (inside || threads == 1 || chunks <= 1)
+	{
+		for (int64_t chunk = 0; chunk < chunks; chunk++)
+		{
+			run(&job, chunk);
+		}
+		return;
+	}
+
+	pthread_mutex_lock(&serial);
+	pthread_mutex_lock(&pool.lock);
+	job.threads = spawn(chunks < threads ? (int)chunks : (int)threads);
+
+	/* the workers of the last job are all done, nobody else touches the shares */
+	for (int i = 0; i < job.threads; i++)
+	{
+		shares[i].next = chunks * i / job.threads;
+		shares[i].end = chunks * (i + 1) / job.threads;
+	}
+
+	pool.job = job;
+	pool.busy = job.threads - 1;
+	pool.generation++;
+	pthread_cond_broadcast(&pool.start);
+	pthread_mutex_unlock(&pool.lock);
+
+	work(&job, 0);
+
+	pthread_mutex_lock(&pool.lock);
+	while (pool.busy > 0)
+	{
+		pthread_cond_wait(&pool.done, &pool.lock);
+	}
+	pthread_mutex_unlock(&pool.lock);
+	pthread_mutex_unlock(&serial);
+}
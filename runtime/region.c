@@ -0,0 +1,121 @@
+/* Per-thread bump allocator behind wf_alloc. Memory comes in chunks; opening a region
+   records the current position in the region itself, leaving it rewinds to that position
+   and keeps the chunks it grew by on a free list, so a loop that opens a region per
+   iteration runs in the memory of its largest iteration. */
+#include "wfrt.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define CHUNK_SIZE (256 * 1024)
+#define ALIGN 16
+
+struct chunk
+{
+	struct chunk *next; /* the previous chunk of the region stack, or the next free one */
+	size_t size;
+};
+
+struct mark
+{
+	struct mark *outer;
+	struct chunk *chunk;
+	char *cursor;
+};
+
+struct region
+{
+	struct chunk *chunk; /* newest chunk */
+	char *cursor;
+	char *limit;
+	struct mark *mark; /* innermost open region */
+	struct chunk *free;
+};
+
+static _Thread_local struct region region;
+
+static void *fail(size_t size)
+{
+	fprintf(stderr, "wf_alloc: out of memory allocating %zu bytes\n", size);
+	abort();
+}
+
+static void grow(size_t size)
+{
+	struct chunk *chunk = region.free;
+	if (chunk && chunk->size - sizeof(struct chunk) >= size)
+	{
+		region.free = chunk->next;
+	}
+	else
+	{
+		size_t chunkSize = size + sizeof(struct chunk) > CHUNK_SIZE ? size + sizeof(struct chunk) : CHUNK_SIZE;
+		chunk = malloc(chunkSize);
+		if (!chunk)
+		{
+			fail(size);
+		}
+		chunk->size = chunkSize;
+	}
+
+	chunk->next = region.chunk;
+	region.chunk = chunk;
+	region.cursor = (char *)(chunk + 1);
+	region.limit = (char *)chunk + chunk->size;
+}
+
+void *wf_alloc(int64_t size)
+{
+	if (size < 0)
+	{
+		fprintf(stderr, "wf_alloc: negative size %lld\n", (long long)size);
+		abort();
+	}
+
+	size_t rounded = ((size_t)size + ALIGN - 1) & ~(size_t)(ALIGN - 1);
+	if (rounded > (size_t)(region.limit - region.cursor))
+	{
+		grow(rounded);
+	}
+
+	void *result = region.cursor;
+	region.cursor += rounded;
+	return result;
+}
+
+void wf_region_enter(void)
+{
+	struct mark saved = {region.mark, region.chunk, region.cursor};
+	struct mark *mark = wf_alloc(sizeof(struct mark));
+	*mark = saved;
+	region.mark = mark;
+}
+
+void wf_region_leave(void)
+{
+	struct mark *mark = region.mark;
+	if (!mark)
+	{
+		return;
+	}
+
+	struct mark saved = *mark; /* the mark lives in the memory about to be released */
+	while (region.chunk != saved.chunk)
+	{
+		struct chunk *chunk = region.chunk;
+		region.chunk = chunk->next;
+
+		if (chunk->size > CHUNK_SIZE) /* one-off large allocations go back to the heap */
+		{
+			free(chunk);
+			continue;
+		}
+
+		chunk->next = region.free;
+		region.free = chunk;
+	}
+
+	region.cursor = saved.cursor;
+	region.limit = saved.chunk ? (char *)saved.chunk + saved.chunk->size : NULL;
+	region.mark = saved.outer;
+}
@@ -0,0 +1,71 @@
+/* weirdflex runtime, linked into every program (libwfrt.a) and into the compiler itself for `run`. */
+#ifndef WFRT_H
+#define WFRT_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Allocates size bytes from the innermost open region of the calling thread, or from the
+   thread's base region, which is never released, outside of any region. */
+void *wf_alloc(int64_t size);
+
+/* region { ... } opens a region on entry and leaves it on every exit; leaving releases
+   everything allocated since the matching enter at once. Regions nest. */
+void wf_region_enter(void);
+void wf_region_leave(void);
+
+/* Reports an out of range slice index or bound and aborts (not with --unchecked). */
+void wf_bounds_fail(int64_t index, int64_t length) __attribute__((noreturn, cold));
+
+/* parallel for runs its body, outlined by the compiler, over chunks of the iteration range: one
+   call runs iterations begin..end-1, the chunk'th chunk of the loop. */
+typedef void (*wf_chunk_fn)(void *env, int64_t begin, int64_t end, int64_t chunk);
+
+/* Runs iterations begin..end-1 in chunks on the thread pool and the calling thread and returns
+   once all are done. Inside a chunk, a nested loop runs on the calling thread alone. */
+void wf_parallel_for(wf_chunk_fn body, void *env, int64_t begin, int64_t end, int64_t grain);
+
+/* Iterations per chunk: grain if positive, else WF_GRAIN from the environment, else enough for
+   about 256 chunks. Neither this nor the chunks depend on the number of threads. */
+int64_t wf_parallel_grain(int64_t begin, int64_t end, int64_t grain);
+int64_t wf_parallel_chunks(int64_t begin, int64_t end, int64_t grain);
+
+/* Threads a parallel for runs on, the caller included. WF_THREADS from the environment or the
+   number of CPUs until set; n <= 0 goes back to that. */
+void wf_set_threads(int64_t n);
+int64_t wf_threads(void);
+
+/* A string as programs pass it around: data is NUL-terminated, length leaves the NUL out. */
+typedef struct
+{
+	char *data;
+	int64_t length;
+} wf_string;
+
+/* An async function runs as a coroutine, a task is its handle. wf_run resumes the tasks made
+   ready, in order, until none is ready and no read, write or sleep is waiting; it returns 0, or
+   -1 if waiting failed. Either way it gives back the file status flags of the descriptors it made
+   non-blocking. The loop is single-threaded: call it from one thread only. */
+void wf_task_ready(void *task);
+int64_t wf_run(void);
+
+/* The frame of a task, unless the optimizer keeps it in the frame of the task awaiting it. */
+void *wf_task_frame(int64_t size);
+void wf_task_free(void *frame);
+
+/* await read, write and sleep: each stores its result and returns 1 if done at once, else it
+   returns 0, task suspends and wf_run makes it ready once the result is stored. read gives at most
+   max bytes, allocated with wf_alloc, and an empty string at the end of input or on an error;
+   write gives the bytes written, all of them unless it fails with -1; sleep gives 0. */
+int64_t wf_read(void *task, int64_t fd, int64_t max, wf_string *result);
+int64_t wf_write(void *task, int64_t fd, const char *data, int64_t length, int64_t *result);
+int64_t wf_sleep(void *task, int64_t milliseconds, int64_t *result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,612 @@
+#include "sema.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "parser.hpp"
+
+using namespace std;
+using namespace Node;
+
+void Sema::resolveTopLevel(Statement &stmt)
+{
+	if (scopes.empty())
+	{
+		scopes.emplace_back(); // top level
+	}
+
+	stmt.resolve(*this);
+}
+
+void Sema::capture(const VariableDeclaration *decl)
+{
+	for (auto &outline : outlines)
+	{
+		auto &captures = outline.loop->captures;
+		if (outline.scope == scopes.size() && !outline.inner.count(decl) && find(captures.begin(), captures.end(), decl) == captures.end())
+		{
+			captures.push_back(decl);
+		}
+	}
+}
+
+bool Sema::shared(const VariableDeclaration *decl) const
+{
+	for (auto &outline : outlines)
+	{
+		if (outline.scope == scopes.size() && (!outline.inner.count(decl) || &outline.loop->index == decl))
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool Sema::outlined() const
+{
+	return !outlines.empty() && outlines.back().scope == scopes.size();
+}
+
+void Integer::resolve(Sema &sema)
+{
+	resolvedType = InternalType::Integer;
+}
+
+void Float::resolve(Sema &sema)
+{
+	resolvedType = InternalType::Float;
+}
+
+void String::resolve(Sema &sema)
+{
+	resolvedType = InternalType::String;
+}
+
+void Identifier::resolve(Sema &sema)
+{
+	decl = sema.lookup(symbol);
+	if (!decl)
+	{
+		throw runtime_error("(Identifier) undeclared variable " + name + '\n');
+	}
+
+	sema.capture(decl);
+	resolvedType = decl->resolvedType;
+}
+
+Builtin builtinFor(const Identifier &id)
+{
+	if (lanesOf(typeOf2(id)))
+	{
+		return Builtin::Vector;
+	}
+
+	static const std::pair<const char *, Builtin> names[] = {
+		{"shuffle", Builtin::Shuffle},
+		{"reduce_add", Builtin::ReduceAdd},
+		{"reduce_mul", Builtin::ReduceMul},
+		{"reduce_min", Builtin::ReduceMin},
+		{"reduce_max", Builtin::ReduceMax},
+		{"vload4", Builtin::Load},
+		{"vload8", Builtin::Load},
+		{"vstore", Builtin::Store},
+		{"read", Builtin::Read},
+		{"write", Builtin::Write},
+		{"sleep", Builtin::Sleep},
+	};
+
+	for (auto &[name, builtin] : names)
+	{
+		if (id.name == name)
+		{
+			return builtin;
+		}
+	}
+
+	return Builtin::None;
+}
+
+InternalType vectorOf(InternalType scalar, unsigned lanes)
+{
+	if (scalar == InternalType::Integer && (lanes == 4 || lanes == 8))
+	{
+		return lanes == 4 ? InternalType::Int4 : InternalType::Int8;
+	}
+	if (scalar == InternalType::Float && (lanes == 4 || lanes == 8))
+	{
+		return lanes == 4 ? InternalType::Float4 : InternalType::Float8;
+	}
+
+	throw runtime_error("there is no vector type of " + to_string(lanes) + " lanes");
+}
+
+InternalType elementOf(InternalType slice);
+
+InternalType resolveBuiltin(const MethodCall &call)
+{
+	auto &args = call.args;
+	auto expect = [&](bool ok, const char *usage) {
+		if (!ok)
+		{
+			throw runtime_error("usage: " + std::string(usage));
+		}
+	};
+	auto isVector = [&](size_t i) { return i < args.size() && lanesOf(args[i]->resolvedType); };
+	auto isInteger = [&](size_t i) { return i < args.size() && args[i]->resolvedType == InternalType::Integer; };
+
+	switch (call.builtin)
+	{
+	case Builtin::Vector:
+	{
+		auto type = typeOf2(call.id);
+		expect(args.size() == 1 || args.size() == lanesOf(type), "int4(a, b, c, d) or int4(all)");
+		for (auto arg : args)
+		{
+			expect(arg->resolvedType == scalarOf(type), "vector lanes must have the vector's element type");
+		}
+
+		return type;
+	}
+
+	case Builtin::Shuffle:
+	{
+		// shuffle(v, lane...) or shuffle(a, b, lane...), lanes index into a then b
+		expect(isVector(0), "shuffle(v, lane...) or shuffle(a, b, lane...)");
+		auto first = isVector(1) ? 2 : 1;
+		expect(first == 1 || args[1]->resolvedType == args[0]->resolvedType, "shuffle(a, b, lane...) needs a and b of one type");
+		auto sources = lanesOf(args[0]->resolvedType) * first; // lanes of a, then of b
+		for (size_t i = first; i < args.size(); i++)
+		{
+			auto lane = dynamic_cast<const Integer *>(args[i]);
+			expect(lane, "shuffle lanes must be integer literals");
+			if (lane->value >= sources) // negative ones wrap around to huge
+			{
+				throw runtime_error("shuffle lane " + to_string(int64_t(lane->value)) + " is not in 0.." + to_string(sources - 1));
+			}
+		}
+
+		return vectorOf(scalarOf(args[0]->resolvedType), args.size() - first);
+	}
+
+	case Builtin::ReduceAdd:
+	case Builtin::ReduceMul:
+	case Builtin::ReduceMin:
+	case Builtin::ReduceMax:
+		expect(args.size() == 1 && isVector(0), "reduce_add(v)");
+		return scalarOf(args[0]->resolvedType);
+
+	case Builtin::Load:
+	{
+		// vload4(a, i) or vload4(a, i, mask): elements i.. of a, masked off lanes are 0
+		unsigned lanes = call.id.name == "vload4" ? 4 : 8;
+		expect((args.size() == 2 || args.size() == 3) && isInteger(1), "vload4(slice, index) or vload4(slice, index, mask)");
+		auto type = vectorOf(elementOf(args[0]->resolvedType), lanes);
+		expect(args.size() == 2 || args[2]->resolvedType == vectorOf(InternalType::Integer, lanes), "the mask of vload4 is an int4, of vload8 an int8");
+		return type;
+	}
+
+	case Builtin::Store:
+	{
+		// vstore(a, i, v) or vstore(a, i, v, mask)
+		expect((args.size() == 3 || args.size() == 4) && isInteger(1) && isVector(2), "vstore(slice, index, vector) or vstore(slice, index, vector, mask)");
+		auto type = args[2]->resolvedType;
+		expect(scalarOf(type) == elementOf(args[0]->resolvedType), "vstore needs a vector of the slice's element type");
+		expect(args.size() == 3 || args[3]->resolvedType == vectorOf(InternalType::Integer, lanesOf(type)), "the mask of vstore is an int vector of as many lanes");
+		return type;
+	}
+
+	case Builtin::Read:
+		// the at most max bytes there are, an empty string at the end of input
+		expect(call.task && args.size() == 2 && isInteger(0) && isInteger(1), "await read(fd, max)");
+		return InternalType::String;
+
+	case Builtin::Write:
+		// the bytes written, all of s unless it fails with -1
+		expect(call.task && args.size() == 2 && isInteger(0) && args[1]->resolvedType == InternalType::String, "await write(fd, s)");
+		return InternalType::Integer;
+
+	case Builtin::Sleep:
+		expect(call.task && args.size() == 1 && isInteger(0), "await sleep(ms)");
+		return InternalType::Integer;
+
+	default:
+		throw runtime_error("function '" + call.id.name + "' not found");
+	}
+}
+
+void MethodCall::resolve(Sema &sema)
+{
+	for (auto arg : args)
+	{
+		arg->resolve(sema);
+	}
+
+	auto function = sema.functions.find(id.symbol);
+	if (!function)
+	{
+		builtin = builtinFor(id);
+		resolvedType = resolveBuiltin(*this);
+		return;
+	}
+
+	decl = *function;
+	resolvedType = decl->resolvedType;
+
+	if (decl->async && !task)
+	{
+		throw runtime_error("async function " + id.name + " must be called with await or spawn");
+	}
+}
+
+void Await::resolve(Sema &sema)
+{
+	if (!sema.function || !sema.function->async)
+	{
+		throw runtime_error("await outside of an async function");
+	}
+	if (sema.regions)
+	{
+		throw runtime_error("await inside a region, other tasks run while it waits");
+	}
+	if (sema.outlined())
+	{
+		throw runtime_error("await inside a parallel for");
+	}
+
+	call.task = true;
+	call.resolve(sema);
+
+	if (call.decl ? !call.decl->async : call.builtin != Builtin::Read && call.builtin != Builtin::Write && call.builtin != Builtin::Sleep)
+	{
+		throw runtime_error("await needs an async function or read, write or sleep, " + call.id.name + " is neither");
+	}
+
+	resolvedType = call.resolvedType;
+}
+
+void SpawnStatement::resolve(Sema &sema)
+{
+	if (sema.regions)
+	{
+		throw runtime_error("spawn inside a region, the task outlives it");
+	}
+	if (sema.outlined())
+	{
+		throw runtime_error("spawn inside a parallel for");
+	}
+
+	call.task = true;
+	call.resolve(sema);
+
+	if (!call.decl || !call.decl->async)
+	{
+		throw runtime_error("spawn needs an async function, " + call.id.name + " is not");
+	}
+}
+
+void BinaryOperator::resolve(Sema &sema)
+{
+	lhs->resolve(sema);
+	rhs->resolve(sema);
+
+	if (lhs->resolvedType != rhs->resolvedType)
+	{
+		throw runtime_error("cannot create binary operator for different argument types");
+	}
+
+	switch (op)
+	{
+	case EQ:
+	case NE:
+	case LT:
+	case GT:
+	case LE:
+	case GE:
+		// 0 or 1, per lane for vectors
+		resolvedType = lanesOf(lhs->resolvedType) ? vectorOf(InternalType::Integer, lanesOf(lhs->resolvedType)) : InternalType::Integer;
+		break;
+
+	default:
+		resolvedType = lhs->resolvedType;
+	}
+}
+
+InternalType elementOf(InternalType slice)
+{
+	switch (slice)
+	{
+	case InternalType::IntSlice:
+		return InternalType::Integer;
+	case InternalType::FloatSlice:
+		return InternalType::Float;
+	default:
+		throw runtime_error("only slices can be indexed");
+	}
+}
+
+void resolveIndex(Sema &sema, Expression &index)
+{
+	index.resolve(sema);
+
+	if (index.resolvedType != InternalType::Integer)
+	{
+		throw runtime_error("slice index must be an int");
+	}
+}
+
+void SliceAllocation::resolve(Sema &sema)
+{
+	resolvedType = typeOf2(type);
+	elementOf(resolvedType);
+	resolveIndex(sema, length);
+}
+
+void ArrayIndex::resolve(Sema &sema)
+{
+	array.resolve(sema);
+	resolveIndex(sema, index);
+	resolvedType = lanesOf(array.resolvedType) ? scalarOf(array.resolvedType) : elementOf(array.resolvedType); // a slice element or a vector lane
+}
+
+void ArrayAssignment::resolve(Sema &sema)
+{
+	array.resolve(sema);
+	resolveIndex(sema, index);
+	rhs.resolve(sema);
+
+	resolvedType = elementOf(array.resolvedType);
+	if (rhs.resolvedType != resolvedType)
+	{
+		throw runtime_error("cannot assign to an element of " + array.name + ": wrong type");
+	}
+}
+
+void SubSlice::resolve(Sema &sema)
+{
+	array.resolve(sema);
+	resolveIndex(sema, low);
+	resolveIndex(sema, high);
+
+	resolvedType = array.resolvedType;
+	elementOf(resolvedType);
+}
+
+void Length::resolve(Sema &sema)
+{
+	operand.resolve(sema);
+
+	if (operand.resolvedType != InternalType::String)
+	{
+		elementOf(operand.resolvedType);
+	}
+
+	resolvedType = InternalType::Integer;
+}
+
+// Strings and slices point into the region they were allocated in
+bool regionAllocated(InternalType type)
+{
+	return type == InternalType::String || type == InternalType::IntSlice || type == InternalType::FloatSlice;
+}
+
+void Assignment::resolve(Sema &sema)
+{
+	rhs.resolve(sema);
+
+	auto decl = sema.lookup(lhs.symbol);
+	if (!decl)
+	{
+		throw runtime_error("(Assignment) undeclared variable: " + lhs.name);
+	}
+	if (sema.shared(decl))
+	{
+		throw runtime_error("cannot assign to " + lhs.name + " in a parallel for, its iterations run at the same time");
+	}
+	if (decl->regions < sema.regions && regionAllocated(rhs.resolvedType))
+	{
+		throw runtime_error("cannot assign a string or slice to " + lhs.name + " inside a region, " + lhs.name + " outlives it");
+	}
+
+	resolvedType = rhs.resolvedType;
+}
+
+void Block::resolve(Sema &sema)
+{
+	for (auto s : stmts)
+	{
+		s->resolve(sema);
+	}
+}
+
+void RegionStatement::resolve(Sema &sema)
+{
+	sema.regions++;
+	block.resolve(sema);
+	sema.regions--;
+}
+
+void resolveCondition(Sema &sema, Expression &condition)
+{
+	condition.resolve(sema);
+
+	if (condition.resolvedType != InternalType::Integer && condition.resolvedType != InternalType::Float)
+	{
+		throw runtime_error("condition must be a number");
+	}
+}
+
+void LoopStatement::resolve(Sema &sema)
+{
+	if (init)
+	{
+		init->resolve(sema);
+	}
+
+	resolveCondition(sema, condition);
+	body.resolve(sema);
+
+	if (step)
+	{
+		step->resolve(sema);
+	}
+}
+
+void ParallelFor::resolve(Sema &sema)
+{
+	if (grain)
+	{
+		grain->resolve(sema);
+		if (grain->resolvedType != InternalType::Integer)
+		{
+			throw runtime_error("the grain of a parallel for must be an int");
+		}
+	}
+
+	high.resolve(sema);
+
+	// the index and what the body declares are locals of the outlined body, not of the function
+	auto scope = sema.scopes.back();
+	index.resolve(sema);
+	if (index.resolvedType != InternalType::Integer || high.resolvedType != InternalType::Integer)
+	{
+		throw runtime_error("a parallel for runs over a range of ints");
+	}
+
+	sema.outlines.push_back(Sema::Outline{loop : this, scope : sema.scopes.size(), inner : {&index}});
+	body.resolve(sema);
+	sema.outlines.pop_back();
+	sema.scopes.back() = std::move(scope);
+
+	if (!op)
+	{
+		return;
+	}
+	if (op != PLUS && op != MUL)
+	{
+		throw runtime_error("a parallel for reduces with + or *");
+	}
+
+	// the value of an iteration is its last statement's
+	auto last = body.stmts.empty() ? nullptr : dynamic_cast<ExpressionStatement *>(body.stmts.back());
+	if (!last || dynamic_cast<Assignment *>(&last->expr))
+	{
+		throw runtime_error("the body of parallel " + string(op == PLUS ? "+" : "*") + " for must end in the value of the iteration");
+	}
+
+	resolvedType = last->expr.resolvedType;
+	if (scalarOf(resolvedType) != InternalType::Integer && scalarOf(resolvedType) != InternalType::Float)
+	{
+		throw runtime_error("a parallel for reduces ints, doubles or their vectors");
+	}
+}
+
+void IfStatement::resolve(Sema &sema)
+{
+	resolveCondition(sema, condition);
+	then.resolve(sema);
+
+	if (otherwise)
+	{
+		otherwise->resolve(sema);
+	}
+}
+
+void BranchStatement::resolve(Sema &sema)
+{
+}
+
+void ExpressionStatement::resolve(Sema &sema)
+{
+	expr.resolve(sema);
+}
+
+void ReturnStatement::resolve(Sema &sema)
+{
+	if (sema.outlined())
+	{
+		throw runtime_error("return inside a parallel for");
+	}
+
+	rhs.resolve(sema);
+
+	// leaving the region releases what the value points to
+	if (sema.regions && regionAllocated(rhs.resolvedType))
+	{
+		throw runtime_error("cannot return a string or slice from inside a region, it is released on return");
+	}
+}
+
+void VariableDeclaration::resolve(Sema &sema)
+{
+	if (rhs)
+	{
+		rhs->resolve(sema);
+	}
+
+	resolvedType = type ? typeOf2(*type) : rhs->resolvedType;
+	regions = sema.regions;
+
+	if (id)
+	{
+		sema.declare(id->symbol, this);
+	}
+}
+
+void FunctionDeclaration::resolve(Sema &sema)
+{
+	resolvedType = type ? typeOf2(*type) : InternalType::Invalid;
+
+	if (async && external)
+	{
+		throw runtime_error("extern function " + id->name + " cannot be async");
+	}
+	if (async && lanesOf(resolvedType))
+	{
+		throw runtime_error("async function cannot return a vector"); // its result is kept in the task, aligned to 8
+	}
+
+	if (id) // declared before the body so it can call itself
+	{
+		sema.functions[id->symbol] = this;
+	}
+
+	auto outer = sema.function;
+	auto regions = sema.regions;
+	sema.function = this;
+	sema.regions = 0;
+
+	sema.scopes.emplace_back();
+	args.resolve(sema);
+	if (block)
+	{
+		block->resolve(sema);
+	}
+	sema.scopes.pop_back();
+
+	sema.function = outer;
+	sema.regions = regions;
+}
+
+void ArgumentList::resolve(Sema &sema)
+{
+	for (auto arg : args)
+	{
+		arg->resolve(sema);
+	}
+}
+
+void AddressOf::resolve(Sema &sema)
+{
+	auto decl = sema.lookup(ident->symbol);
+	if (!decl)
+	{
+		throw runtime_error("(Identifier) undeclared variable " + ident->name + '\n');
+	}
+	if (sema.shared(decl))
+	{
+		throw runtime_error("cannot take the address of " + ident->name + " in a parallel for");
+	}
+
+	decl->addressTaken = true;
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include <set>
+#include <vector>
+
+#include "codegen.hpp"
+#include "node.hpp"
+
+// Name and type resolution. Runs over each top-level statement before its code is
+// generated: every expression gets its InternalType and every identifier and call
+// is bound to its declaration, so codeGen only reads the annotations.
+struct Sema
+{
+	Container<const Node::FunctionDeclaration *> functions;
+	std::vector<Container<const Node::VariableDeclaration *>> scopes; // args and locals, one per function
+
+	// A parallel for body being resolved: variables it uses that are not declared inside are captured
+	struct Outline
+	{
+		Node::ParallelFor *loop;
+		size_t scope; // the function it is in
+		std::set<const Node::VariableDeclaration *> inner;
+	};
+	std::vector<Outline> outlines; // innermost last
+
+	const Node::FunctionDeclaration *function = nullptr; // being resolved, null at the top level
+	unsigned regions = 0;								 // region statements open in it
+
+	void resolveTopLevel(Node::Statement &stmt);
+
+	void declare(Symbol symbol, const Node::VariableDeclaration *decl)
+	{
+		scopes.back()[symbol] = decl;
+		for (auto &outline : outlines)
+		{
+			outline.inner.insert(decl);
+		}
+	}
+
+	const Node::VariableDeclaration *lookup(Symbol symbol) const
+	{
+		return scopes.back().find(symbol).value_or(nullptr);
+	}
+
+	void capture(const Node::VariableDeclaration *decl);
+	bool shared(const Node::VariableDeclaration *decl) const; // captured by or the index of a parallel for
+	bool outlined() const;									   // in the body of a parallel for of this function
+};
@@ -0,0 +1,105 @@
+#pragma once
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Program text that the scanner reads in place with yy_scan_buffer. Flex needs two
+// NUL bytes after the text and writes into the buffer while scanning, so files are
+// mapped privately (copy on write) on top of an anonymous region that is two bytes
+// longer than the file: whatever lies past the end of the file reads as zero.
+struct SourceBuffer
+{
+	char *data = nullptr;
+	size_t size = 0; // without the two NULs
+
+	SourceBuffer() = default;
+	SourceBuffer(const SourceBuffer &) = delete;
+	SourceBuffer &operator=(const SourceBuffer &) = delete;
+
+	~SourceBuffer()
+	{
+		if (mapped)
+		{
+			munmap(data, mapped);
+		}
+	}
+
+	std::string_view text() const
+	{
+		return {data, size};
+	}
+
+	// Returns nullptr if the file cannot be opened
+	static std::unique_ptr<SourceBuffer> map(const char *path)
+	{
+		auto fd = open(path, O_RDONLY);
+		if (fd < 0)
+		{
+			return nullptr;
+		}
+
+		struct stat status;
+		if (fstat(fd, &status) != 0 || !S_ISREG(status.st_mode))
+		{
+			auto file = fdopen(fd, "r");
+			return file ? read(file, true) : nullptr;
+		}
+
+		auto buffer = std::make_unique<SourceBuffer>();
+		buffer->size = status.st_size;
+		buffer->mapped = buffer->size + 2;
+
+		auto base = mmap(nullptr, buffer->mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (base != MAP_FAILED && buffer->size > 0 && mmap(base, buffer->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+		{
+			munmap(base, buffer->mapped);
+			base = MAP_FAILED;
+		}
+
+		close(fd);
+
+		if (base == MAP_FAILED)
+		{
+			return nullptr;
+		}
+
+		buffer->data = static_cast<char *>(base);
+		return buffer;
+	}
+
+	// For pipes (stdin): reads everything into memory. Returns nullptr on a read error.
+	static std::unique_ptr<SourceBuffer> read(FILE *input, bool close = false)
+	{
+		auto buffer = std::make_unique<SourceBuffer>();
+		char chunk[64 * 1024];
+		while (auto n = fread(chunk, 1, sizeof(chunk), input))
+		{
+			buffer->storage.append(chunk, n);
+		}
+
+		auto failed = ferror(input);
+		if (close)
+		{
+			fclose(input);
+		}
+
+		if (failed)
+		{
+			return nullptr;
+		}
+
+		buffer->size = buffer->storage.size();
+		buffer->storage.append(2, '\0');
+		buffer->data = buffer->storage.data();
+		return buffer;
+	}
+
+private:
+	size_t mapped = 0; // length of the mapping, 0 if the text lives in storage
+	std::string storage;
+};
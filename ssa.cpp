@@ -0,0 +1,143 @@
+#include "ssa.hpp"
+
+#include <llvm/IR/BasicBlock.h>
+#include <llvm/IR/CFG.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/ValueHandle.h>
+
+using namespace llvm;
+
+void SSABuilder::declare(Symbol variable, Type *type)
+{
+	types[variable] = type;
+}
+
+void SSABuilder::writeVariable(Symbol variable, BasicBlock *block, Value *value)
+{
+	currentDef[block][variable] = value;
+}
+
+Value *SSABuilder::readVariable(Symbol variable, BasicBlock *block)
+{
+	if (auto value = currentDef[block].find(variable))
+	{
+		return *value;
+	}
+
+	return readVariableRecursive(variable, block);
+}
+
+Value *SSABuilder::readVariableRecursive(Symbol variable, BasicBlock *block)
+{
+	auto type = *types.find(variable);
+	Value *value;
+
+	if (!sealedBlocks.count(block))
+	{
+		// incomplete CFG: the operands are added when the block is sealed
+		auto phi = IRBuilder<>(block, block->begin()).CreatePHI(type, 2);
+		incompletePhis[block].emplace_back(variable, phi);
+		value = phi;
+	}
+	else if (pred_empty(block))
+	{
+		value = UndefValue::get(type); // read before any assignment
+	}
+	else if (auto single = block->getSinglePredecessor())
+	{
+		value = readVariable(variable, single); // no phi needed
+	}
+	else
+	{
+		// break potential cycles with an operandless phi
+		auto phi = IRBuilder<>(block, block->begin()).CreatePHI(type, 2);
+		writeVariable(variable, block, phi);
+		value = addPhiOperands(variable, phi);
+	}
+
+	writeVariable(variable, block, value);
+	return value;
+}
+
+Value *SSABuilder::addPhiOperands(Symbol variable, PHINode *phi)
+{
+	for (auto predecessor : predecessors(phi->getParent()))
+	{
+		phi->addIncoming(readVariable(variable, predecessor), predecessor);
+	}
+
+	return tryRemoveTrivialPhi(phi);
+}
+
+Value *SSABuilder::tryRemoveTrivialPhi(PHINode *phi)
+{
+	Value *same = nullptr;
+	for (auto &operand : phi->incoming_values())
+	{
+		if (operand == same || operand == phi)
+		{
+			continue; // unique value or self-reference
+		}
+
+		if (same)
+		{
+			return phi; // merges at least two values: not trivial
+		}
+
+		same = operand;
+	}
+
+	if (!same)
+	{
+		same = UndefValue::get(phi->getType()); // unreachable or in the entry block
+	}
+
+	// remember the phis using this one, they might become trivial in turn; phis of unsealed
+	// blocks are skipped, their operands are not all there yet
+	std::vector<WeakVH> users;
+	for (auto user : phi->users())
+	{
+		if (auto userPhi = dyn_cast<PHINode>(user); userPhi && userPhi != phi && sealedBlocks.count(userPhi->getParent()))
+		{
+			users.emplace_back(userPhi);
+		}
+	}
+
+	phi->replaceAllUsesWith(same);
+	for (auto &definitions : currentDef)
+	{
+		for (auto &slot : definitions.second.slots)
+		{
+			if (slot.key && slot.value == phi)
+			{
+				slot.value = same;
+			}
+		}
+	}
+
+	phi->eraseFromParent();
+
+	for (auto &user : users)
+	{
+		if (user) // not removed by an earlier iteration
+		{
+			tryRemoveTrivialPhi(cast<PHINode>(user));
+		}
+	}
+
+	return same;
+}
+
+void SSABuilder::sealBlock(BasicBlock *block)
+{
+	auto pending = std::move(incompletePhis[block]);
+	incompletePhis.erase(block);
+	sealedBlocks.insert(block);
+
+	for (auto &[variable, phi] : pending)
+	{
+		addPhiOperands(variable, phi);
+	}
+}
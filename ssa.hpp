@@ -0,0 +1,40 @@
+#pragma once
+#include <utility>
+#include <vector>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/DenseSet.h>
+
+#include "container.hpp"
+
+namespace llvm
+{
+class BasicBlock;
+class PHINode;
+class Type;
+class Value;
+} // namespace llvm
+
+// Builds SSA form for the locals of one function while its code is generated
+// (Braun et al., "Simple and Efficient Construction of Static Single Assignment
+// Form"): the current value of every variable is tracked per basic block, and
+// reads in blocks without a local definition look through the predecessors,
+// placing phis where paths merge. A block is sealed once all of its predecessors
+// are known; reads in unsealed blocks get placeholder phis that are completed when
+// it is sealed. Phis that turn out to merge a single value are removed again.
+struct SSABuilder
+{
+	void declare(Symbol variable, llvm::Type *type);
+	void writeVariable(Symbol variable, llvm::BasicBlock *block, llvm::Value *value);
+	llvm::Value *readVariable(Symbol variable, llvm::BasicBlock *block);
+	void sealBlock(llvm::BasicBlock *block);
+
+private:
+	llvm::Value *readVariableRecursive(Symbol variable, llvm::BasicBlock *block);
+	llvm::Value *addPhiOperands(Symbol variable, llvm::PHINode *phi);
+	llvm::Value *tryRemoveTrivialPhi(llvm::PHINode *phi);
+
+	Container<llvm::Type *> types;
+	llvm::DenseMap<llvm::BasicBlock *, Container<llvm::Value *>> currentDef;
+	llvm::DenseMap<llvm::BasicBlock *, std::vector<std::pair<Symbol, llvm::PHINode *>>> incompletePhis;
+	llvm::DenseSet<llvm::BasicBlock *> sealedBlocks;
+};
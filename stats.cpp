@@ -0,0 +1,121 @@
+#include "stats.hpp"
+
+#include <llvm/Support/Format.h>
+#include <llvm/Support/Timer.h>
+#include <llvm/Support/raw_ostream.h>
+
+using namespace llvm;
+
+void CompileStats::addPhase(const std::string &name, double seconds)
+{
+	for (auto &phase : phases)
+	{
+		if (phase.first == name)
+		{
+			phase.second += seconds;
+			return;
+		}
+	}
+
+	phases.emplace_back(name, seconds);
+}
+
+void CompileStats::count(const std::string &name, uint64_t value)
+{
+	for (auto &counter : counters)
+	{
+		if (counter.first == name)
+		{
+			counter.second = value;
+			return;
+		}
+	}
+
+	counters.emplace_back(name, value);
+}
+
+void CompileStats::add(const std::string &name, uint64_t value)
+{
+	for (auto &counter : counters)
+	{
+		if (counter.first == name)
+		{
+			counter.second += value;
+			return;
+		}
+	}
+
+	counters.emplace_back(name, value);
+}
+
+void CompileStats::merge(const CompileStats &other)
+{
+	for (auto &phase : other.phases)
+	{
+		addPhase(phase.first, phase.second);
+	}
+
+	for (auto &counter : other.counters)
+	{
+		add(counter.first, counter.second);
+	}
+}
+
+void CompileStats::printPhases(raw_ostream &os) const
+{
+	double total = 0;
+	for (auto &phase : phases)
+	{
+		total += phase.second;
+	}
+
+	os << "===" << std::string(60, '-') << "===\n";
+	os << "  Compiler phase timing\n";
+	os << "===" << std::string(60, '-') << "===\n";
+
+	for (auto &phase : phases)
+	{
+		os << format("  %10.4fs %5.1f%%  ", phase.second, total > 0 ? 100 * phase.second / total : 0.0) << phase.first << '\n';
+	}
+
+	os << format("  %10.4fs %5.1f%%  ", total, 100.0) << "total\n";
+}
+
+void CompileStats::printCounters(raw_ostream &os) const
+{
+	for (auto &counter : counters)
+	{
+		os << format("  %12llu  ", static_cast<unsigned long long>(counter.second)) << counter.first << '\n';
+	}
+}
+
+void CompileStats::printJSON(raw_ostream &os, bool withPassTimers) const
+{
+	const char *delim = "\n";
+
+	os << "{\n\t\"phases\": {";
+	for (auto &phase : phases)
+	{
+		os << delim << "\t\t\"" << phase.first << "\": " << format("%.6f", phase.second);
+		delim = ",\n";
+	}
+
+	delim = "\n";
+	os << "\n\t},\n\t\"counters\": {";
+	for (auto &counter : counters)
+	{
+		os << delim << "\t\t\"" << counter.first << "\": " << counter.second;
+		delim = ",\n";
+	}
+	os << "\n\t}";
+
+	if (withPassTimers)
+	{
+		// per-pass timers collected by LLVM while TimePassesIsEnabled was set
+		os << ",\n\t\"llvm\": {";
+		TimerGroup::printAllJSONValues(os, "\n");
+		os << "\n\t}";
+	}
+
+	os << "\n}\n";
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace llvm
+{
+class raw_ostream;
+} // namespace llvm
+
+// Compile-time instrumentation: wall time of each compiler phase plus size
+// counters, reported as a table (--time-report, --stats) or as JSON (--stats-json=)
+struct CompileStats
+{
+	std::vector<std::pair<std::string, double>> phases; // seconds, in execution order
+	std::vector<std::pair<std::string, uint64_t>> counters;
+
+	void addPhase(const std::string &name, double seconds);
+	void count(const std::string &name, uint64_t value);
+	void add(const std::string &name, uint64_t value); // for counters summed over several modules or objects
+	void merge(const CompileStats &other); // sums phases and counters, for multi-file builds
+
+	void printPhases(llvm::raw_ostream &os) const;
+	void printCounters(llvm::raw_ostream &os) const;
+	void printJSON(llvm::raw_ostream &os, bool withPassTimers) const;
+};
+
+// Adds the lifetime of the object to the named phase
+struct PhaseTimer
+{
+	PhaseTimer(CompileStats &stats, const char *name) : stats(stats), name(name), start(std::chrono::steady_clock::now()) {}
+
+	~PhaseTimer()
+	{
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		stats.addPhase(name, elapsed.count());
+	}
+
+private:
+	CompileStats &stats;
+	const char *name;
+	std::chrono::steady_clock::time_point start;
+};
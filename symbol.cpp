@@ -0,0 +1,42 @@
+#include "symbol.hpp"
+
+SymbolTable::SymbolTable()
+{
+	for (auto name : {"", "int", "double", "string", "_untyped", "[]int", "[]double", "int4", "int8", "double4", "double8"})
+	{
+		intern(name);
+	}
+}
+
+Symbol SymbolTable::intern(std::string_view name)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	if (auto it = ids.find(name); it != ids.end())
+	{
+		return it->second;
+	}
+
+	Symbol symbol{static_cast<uint32_t>(names.size())};
+	names.emplace_back(name);
+	ids.emplace(names.back(), symbol);
+	return symbol;
+}
+
+const std::string &SymbolTable::name(Symbol symbol) const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return names[symbol.id];
+}
+
+size_t SymbolTable::size() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return names.size();
+}
+
+SymbolTable &symbols()
+{
+	static SymbolTable table;
+	return table;
+}
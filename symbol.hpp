@@ -0,0 +1,49 @@
+#pragma once
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// Interned identifier: two symbols are equal iff their names are equal
+struct Symbol
+{
+	uint32_t id = 0;
+
+	bool operator==(Symbol other) const { return id == other.id; }
+	bool operator!=(Symbol other) const { return id != other.id; }
+	explicit operator bool() const { return id != 0; }
+};
+
+// Names that the compiler looks up itself are interned up front, in this order
+namespace Symbols
+{
+constexpr Symbol Empty{0};
+constexpr Symbol Int{1};
+constexpr Symbol Double{2};
+constexpr Symbol String{3};
+constexpr Symbol Untyped{4};
+constexpr Symbol IntSlice{5};
+constexpr Symbol DoubleSlice{6};
+constexpr Symbol Int4{7};
+constexpr Symbol Int8{8};
+constexpr Symbol Double4{9};
+constexpr Symbol Double8{10};
+} // namespace Symbols
+
+struct SymbolTable
+{
+	SymbolTable();
+
+	Symbol intern(std::string_view name);
+	const std::string &name(Symbol symbol) const;
+	size_t size() const;
+
+private:
+	mutable std::mutex mutex; // the table is shared by compilations running on several threads
+	std::deque<std::string> names; // stable addresses, the keys below point into it
+	std::unordered_map<std::string_view, Symbol> ids;
+};
+
+SymbolTable &symbols();